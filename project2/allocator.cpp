@@ -0,0 +1,148 @@
+/*	File: allocator.cpp
+	Author: Liam Morris
+	Description: Implements the cluster allocator described in allocator.h.
+*/
+#include <cstdlib>
+#include "allocator.h"
+
+// Shards are made of whole chunks of the bitmap, which keeps a free count per
+// 4096 clusters, so no two shards ever touch the same count
+const int SHARD_ALIGN = 4096;
+
+// Each thread draws a ticket the first time it allocates, and the ticket
+// picks the shard it starts in
+static int next_ticket = 0;
+static __thread int thread_ticket = -1;
+
+cluster_allocator::cluster_allocator(int size, int shards) : size(size) {
+	map = new bitmap(size);
+	if (shards < 1) shards = 1;
+	shard_size = (size + shards - 1) / shards;
+	shard_size = (shard_size + SHARD_ALIGN - 1) / SHARD_ALIGN * SHARD_ALIGN;
+	if (shard_size == 0) shard_size = SHARD_ALIGN;
+	num_shards = (size + shard_size - 1) / shard_size;
+	if (num_shards < 1) num_shards = 1;
+	locks = (pthread_mutex_t*)malloc(num_shards * sizeof(pthread_mutex_t));
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_init(&locks[i], NULL);
+	}
+}
+
+cluster_allocator::~cluster_allocator() {
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_destroy(&locks[i]);
+	}
+	free(locks);
+	delete map;
+}
+
+void cluster_allocator::set(int index) {
+	int shard = shardOf(index);
+	pthread_mutex_lock(&locks[shard]);
+	map->set(index);
+	pthread_mutex_unlock(&locks[shard]);
+}
+
+void cluster_allocator::clear(int index) {
+	int shard = shardOf(index);
+	pthread_mutex_lock(&locks[shard]);
+	map->clear(index);
+	pthread_mutex_unlock(&locks[shard]);
+}
+
+bool cluster_allocator::isSet(int index) {
+	int shard = shardOf(index);
+	pthread_mutex_lock(&locks[shard]);
+	bool used = map->isSet(index);
+	pthread_mutex_unlock(&locks[shard]);
+	return used;
+}
+
+int cluster_allocator::claim(int hint) {
+	int first = hint < 0 || hint >= size ? homeShard() : shardOf(hint);
+	for (int i = 0; i < num_shards; i++) {
+		int shard = (first + i) % num_shards;
+		int from = shard * shard_size;
+		int to = from + shard_size < size ? from + shard_size : size;
+		pthread_mutex_lock(&locks[shard]);
+		int index = map->nextFree(i == 0 && hint >= 0 ? hint : from, from, to);
+		if (index != -1) map->set(index);
+		pthread_mutex_unlock(&locks[shard]);
+		if (index != -1) return index;
+	}
+	return -1;
+}
+
+bool cluster_allocator::claimCluster(int index) {
+	int shard = shardOf(index);
+	pthread_mutex_lock(&locks[shard]);
+	bool taken = map->isSet(index);
+	if (!taken) map->set(index);
+	pthread_mutex_unlock(&locks[shard]);
+	return !taken;
+}
+
+int cluster_allocator::nextFree(int hint) {
+	lockAll();
+	int index = map->nextFree(hint);
+	unlockAll();
+	return index;
+}
+
+bool cluster_allocator::allocate(int count, int hint, std::vector<cluster_extent> &runs) {
+	if (count > map->getFree()) return false;
+	int first = hint < 0 || hint >= size ? homeShard() : shardOf(hint);
+	for (int i = 0; i < num_shards; i++) {
+		int shard = (first + i) % num_shards;
+		int from = shard * shard_size;
+		int to = from + shard_size < size ? from + shard_size : size;
+		if (to - from < count) continue;
+		pthread_mutex_lock(&locks[shard]);
+		bool found = map->allocateRun(count, i == 0 && hint >= 0 ? hint : from, from, to, runs);
+		pthread_mutex_unlock(&locks[shard]);
+		if (found) return true;
+	}
+	// No shard has a run that long, so the runs are picked from the whole
+	// bitmap with every shard locked
+	lockAll();
+	bool found = map->allocate(count, hint < 0 ? first * shard_size : hint, runs);
+	unlockAll();
+	return found;
+}
+
+int cluster_allocator::getFree() {
+	return map->getFree();
+}
+
+int cluster_allocator::getSize() {
+	return size;
+}
+
+void cluster_allocator::freeRuns(std::vector<cluster_extent> &runs) {
+	lockAll();
+	map->freeRuns(runs);
+	unlockAll();
+}
+
+int cluster_allocator::shardOf(int index) {
+	return index / shard_size;
+}
+
+int cluster_allocator::homeShard() {
+	if (thread_ticket == -1) thread_ticket = __sync_fetch_and_add(&next_ticket, 1);
+	return thread_ticket % num_shards;
+}
+
+// Shards are always locked in order, so two threads locking all of them
+// can't deadlock
+void cluster_allocator::lockAll() {
+	for (int i = 0; i < num_shards; i++) {
+		pthread_mutex_lock(&locks[i]);
+	}
+}
+
+void cluster_allocator::unlockAll() {
+	for (int i = num_shards - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&locks[i]);
+	}
+}
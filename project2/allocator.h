@@ -0,0 +1,67 @@
+/*	File: allocator.h
+	Author: Liam Morris
+	Description: Blueprints the cluster allocator, which hands out free clusters
+		     to several threads at once. The free-cluster bitmap is split
+		     into shards with a lock each, and every thread starts looking
+		     in a shard of its own, so threads allocating at the same time
+		     rarely wait on each other and never get the same cluster.
+*/
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+#include <vector>
+#include <pthread.h>
+#include "bitmap.h"
+
+class cluster_allocator {
+public:
+	// constructor
+	// size - number of clusters (all start out free)
+	// shards - most shards to split them into; shards are whole chunks of
+	//          the bitmap, so small images have fewer
+	cluster_allocator(int size, int shards);
+
+	// destructor - the bitmap and the locks need to be cleaned up
+	~cluster_allocator();
+
+	// marks a cluster as used or free
+	void set(int index);
+	void clear(int index);
+	bool isSet(int index);
+
+	// takes a free cluster and marks it used. The shard holding hint is
+	// looked in first, or the calling thread's own shard if hint is -1, then
+	// the others. Returns -1 if every cluster is in use.
+	int claim(int hint = -1);
+
+	// takes one particular cluster and marks it used; returns false if it
+	// is already in use
+	bool claimCluster(int index);
+
+	// returns the first free cluster at or after hint without taking it,
+	// wrapping around to the start; -1 if every cluster is in use
+	int nextFree(int hint);
+
+	// marks count clusters used and appends them to runs in cluster order,
+	// like bitmap::allocate. A single run inside one shard is used when one
+	// exists, starting with the same shard as claim; otherwise the runs are
+	// picked from the whole bitmap. Returns false if there are not enough
+	// free clusters.
+	bool allocate(int count, int hint, std::vector<cluster_extent> &runs);
+
+	int getFree();
+	int getSize();
+	void freeRuns(std::vector<cluster_extent> &runs);
+
+private:
+	int shardOf(int index);
+	int homeShard();
+	void lockAll();
+	void unlockAll();
+
+	bitmap* map;
+	pthread_mutex_t* locks;
+	int num_shards;
+	int shard_size;
+	int size;
+};
+#endif
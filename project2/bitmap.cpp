@@ -0,0 +1,226 @@
+/*	File: bitmap.cpp
+	Author: Liam Morris
+	Description: Implements the free-cluster bitmap described in bitmap.h.
+*/
+
+#include <cstdlib>
+#include <algorithm>
+#include "bitmap.h"
+
+const int WORD_BITS = 64;
+const int CHUNK_WORDS = 64;
+const int CHUNK_BITS = WORD_BITS * CHUNK_WORDS;
+
+// Orderings used when picking runs to allocate
+static bool longerRun(const cluster_extent &a, const cluster_extent &b) {
+	return a.length > b.length;
+}
+
+static bool earlierRun(const cluster_extent &a, const cluster_extent &b) {
+	return a.start < b.start;
+}
+
+// Every cluster starts out free. Bits past the end of the last word are
+// marked used so searches never return them.
+bitmap::bitmap(int size) : size(size), free_count(size) {
+	num_words = (size + WORD_BITS - 1) / WORD_BITS;
+	words = (unsigned long long*)calloc(num_words + 1, sizeof(unsigned long long));
+	for (int i = size; i < num_words * WORD_BITS; i++) {
+		words[i / WORD_BITS] |= 1ULL << (i % WORD_BITS);
+	}
+	int num_chunks = num_words / CHUNK_WORDS + 1;
+	chunk_free = (int*)calloc(num_chunks, sizeof(int));
+	for (int i = 0; i < num_chunks; i++) {
+		chunk_free[i] = CHUNK_BITS;
+		if ((i + 1) * CHUNK_BITS > size) chunk_free[i] = size > i * CHUNK_BITS ? size - i * CHUNK_BITS : 0;
+	}
+}
+
+bitmap::~bitmap() {
+	free(words);
+	free(chunk_free);
+}
+
+void bitmap::set(int index) {
+	unsigned long long mask = 1ULL << (index % WORD_BITS);
+	if (!(words[index / WORD_BITS] & mask)) {
+		words[index / WORD_BITS] |= mask;
+		chunk_free[index / CHUNK_BITS]--;
+		__sync_fetch_and_sub(&free_count, 1);
+	}
+}
+
+void bitmap::clear(int index) {
+	unsigned long long mask = 1ULL << (index % WORD_BITS);
+	if (words[index / WORD_BITS] & mask) {
+		words[index / WORD_BITS] &= ~mask;
+		chunk_free[index / CHUNK_BITS]++;
+		__sync_fetch_and_add(&free_count, 1);
+	}
+}
+
+bool bitmap::isSet(int index) {
+	return words[index / WORD_BITS] & (1ULL << (index % WORD_BITS));
+}
+
+int bitmap::nextFree(int hint) {
+	if (free_count == 0) return -1;
+	return nextFree(hint, 0, size);
+}
+
+int bitmap::nextFree(int hint, int from, int to) {
+	if (hint < from || hint >= to) hint = from;
+	int index = search(hint, to);
+	if (index == -1) index = search(from, hint);
+	return index;
+}
+
+int bitmap::search(int from, int to) {
+	if (from >= to) return -1;
+	int word = from / WORD_BITS;
+	// Ignore the bits before the starting cluster in the first word
+	unsigned long long free_bits = ~words[word] & (~0ULL << (from % WORD_BITS));
+	while (true) {
+		if (free_bits != 0) {
+			int index = word * WORD_BITS + __builtin_ctzll(free_bits);
+			return index < to ? index : -1;
+		}
+		word++;
+		if (word * WORD_BITS >= to) return -1;
+		// Skip chunks that have nothing free
+		while (word % CHUNK_WORDS == 0 && chunk_free[word / CHUNK_WORDS] == 0) {
+			word += CHUNK_WORDS;
+			if (word * WORD_BITS >= to) return -1;
+		}
+		free_bits = ~words[word];
+	}
+}
+
+bool bitmap::allocate(int count, int hint, std::vector<cluster_extent> &runs) {
+	if (count > free_count) return false;
+	if (hint < 0 || hint >= size) hint = 0;
+	std::vector<cluster_extent> chosen;
+	int start = findRun(count, hint, size);
+	if (start == -1) start = findRun(count, 0, size);
+	if (start != -1) {
+		cluster_extent run = { (unsigned int)start, (unsigned int)count };
+		chosen.push_back(run);
+	} else {
+		// No single run fits, so take the largest runs first. Once what is
+		// left fits in one run, finish with the smallest run that holds it.
+		std::vector<cluster_extent> all;
+		freeRuns(all);
+		std::sort(all.begin(), all.end(), longerRun);
+		unsigned int left = count;
+		size_t next = 0;
+		while (left > 0) {
+			int best = -1;
+			for (size_t i = next; i < all.size() && all[i].length >= left; i++) {
+				best = i;
+			}
+			if (best != -1) {
+				cluster_extent run = { all[best].start, left };
+				chosen.push_back(run);
+				left = 0;
+			} else {
+				chosen.push_back(all[next]);
+				left -= all[next].length;
+				next++;
+			}
+		}
+		std::sort(chosen.begin(), chosen.end(), earlierRun);
+	}
+	for (size_t i = 0; i < chosen.size(); i++) {
+		for (unsigned int j = 0; j < chosen[i].length; j++) {
+			set(chosen[i].start + j);
+		}
+		runs.push_back(chosen[i]);
+	}
+	return true;
+}
+
+bool bitmap::allocateRun(int count, int hint, int from, int to, std::vector<cluster_extent> &runs) {
+	if (hint < from || hint >= to) hint = from;
+	int start = findRun(count, hint, to);
+	if (start == -1) start = findRun(count, from, to);
+	if (start == -1) return false;
+	for (int j = 0; j < count; j++) {
+		set(start + j);
+	}
+	cluster_extent run = { (unsigned int)start, (unsigned int)count };
+	runs.push_back(run);
+	return true;
+}
+
+int bitmap::findRun(int length, int from, int to) {
+	int run_start = 0;
+	int run_length = 0;
+	int i = from;
+	while (i < to) {
+		// Whole chunks that are all used or all free are handled in one step
+		if (i % CHUNK_BITS == 0 && i + CHUNK_BITS <= to) {
+			int chunk_free_bits = chunk_free[i / CHUNK_BITS];
+			if (chunk_free_bits == 0) {
+				run_length = 0;
+				i += CHUNK_BITS;
+				continue;
+			}
+			if (chunk_free_bits == CHUNK_BITS) {
+				if (run_length == 0) run_start = i;
+				run_length += CHUNK_BITS;
+				if (run_length >= length) return run_start;
+				i += CHUNK_BITS;
+				continue;
+			}
+		}
+		unsigned long long word = words[i / WORD_BITS];
+		// Whole words that are all used or all free are handled in one step
+		if (i % WORD_BITS == 0 && i + WORD_BITS <= to && (word == ~0ULL || word == 0)) {
+			if (word == 0) {
+				if (run_length == 0) run_start = i;
+				run_length += WORD_BITS;
+				if (run_length >= length) return run_start;
+			} else {
+				run_length = 0;
+			}
+			i += WORD_BITS;
+			continue;
+		}
+		if (word & (1ULL << (i % WORD_BITS))) {
+			run_length = 0;
+		} else {
+			if (run_length == 0) run_start = i;
+			run_length++;
+			if (run_length >= length) return run_start;
+		}
+		i++;
+	}
+	return -1;
+}
+
+void bitmap::freeRuns(std::vector<cluster_extent> &runs) {
+	int i = 0;
+	while (i < size) {
+		i = search(i, size);
+		if (i == -1) break;
+		int start = i;
+		// Extend the run a word at a time while whole words are free
+		while (i < size && !isSet(i)) {
+			if (i % WORD_BITS == 0 && i + WORD_BITS <= size && words[i / WORD_BITS] == 0) {
+				i += WORD_BITS;
+			} else {
+				i++;
+			}
+		}
+		cluster_extent run = { (unsigned int)start, (unsigned int)(i - start) };
+		runs.push_back(run);
+	}
+}
+
+int bitmap::getFree() {
+	return free_count;
+}
+
+int bitmap::getSize() {
+	return size;
+}
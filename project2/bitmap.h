@@ -0,0 +1,73 @@
+/*	File: bitmap.h
+	Author: Liam Morris
+	Description: Blueprints a free-cluster bitmap that is kept alongside the
+		     FAT so that free space can be found without scanning the table.
+*/
+#ifndef BITMAP_H
+#define BITMAP_H
+#include <vector>
+
+// A run of consecutive clusters
+typedef struct {
+	unsigned int start;
+	unsigned int length;
+} cluster_extent;
+
+// One bit per cluster, set when the cluster is in use. Searches work a word
+// at a time so a full word of used clusters is skipped in one step, and a free
+// count is kept for every chunk of 4096 clusters so full (or empty) chunks
+// are skipped without looking at their words.
+class bitmap {
+public:
+	// constructor
+	// size - number of clusters tracked by the bitmap (all start out free)
+	bitmap(int size);
+
+	// destructor - the word array needs to be cleaned up
+	~bitmap();
+
+	// marks a cluster as used or free
+	void set(int index);
+	void clear(int index);
+	bool isSet(int index);
+
+	// returns the first free cluster at or after hint, wrapping around to
+	// the start of the bitmap; -1 if every cluster is in use
+	int nextFree(int hint);
+	// the same, but only looking in [from, to)
+	int nextFree(int hint, int from, int to);
+
+	// marks count clusters used and appends them to runs in cluster order.
+	// A single contiguous run at or after hint is used when one exists,
+	// otherwise the fewest runs that add up to count. Returns false (and
+	// allocates nothing) if there are not enough free clusters.
+	bool allocate(int count, int hint, std::vector<cluster_extent> &runs);
+
+	// marks a single contiguous run of count clusters in [from, to) used,
+	// preferring one at or after hint, and appends it to runs; false if there
+	// is no run that long in the range
+	bool allocateRun(int count, int hint, int from, int to, std::vector<cluster_extent> &runs);
+
+	// number of free clusters, kept as the bits change. The count is updated
+	// atomically, so ranges of the bitmap that start on a chunk boundary can
+	// be changed by different threads at once.
+	int getFree();
+	int getSize();
+
+	// appends every run of free clusters in the bitmap to runs
+	void freeRuns(std::vector<cluster_extent> &runs);
+
+private:
+	// first free cluster in [from, to), -1 if there is none
+	int search(int from, int to);
+
+	// start of the first run of at least length free clusters in [from, to)
+	int findRun(int length, int from, int to);
+
+	unsigned long long* words;
+	int* chunk_free;
+	int num_words;
+	int size;
+	int free_count;
+};
+#endif
@@ -0,0 +1,251 @@
+/*	File: btree.cpp
+	Author: Liam Morris
+	Description: Implements the B-tree of file names described in btree.h.
+		     Full nodes are split on the way down, so an insert never
+		     has to go back up the tree.
+*/
+#include "btree.h"
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+const unsigned int BTREE_MAGIC = 0x45455242;
+
+// Deeper than any tree that fits in a file system, so a damaged tree whose
+// links go round in a circle is given up on instead of followed forever
+const int MAX_DEPTH = 32;
+
+btree::btree(unsigned int cluster_size, unsigned int root, int (*allocate)(void* context, unsigned int root), void* context) {
+	this->cluster_size = cluster_size;
+	this->root = root;
+	this->allocate = allocate;
+	this->context = context;
+	capacity = (cluster_size - sizeof(btree_header)) / sizeof(btree_key);
+}
+
+btree::~btree() {
+	for (unordered_map<unsigned int, char*>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+		free(it->second);
+	}
+}
+
+void btree::format() {
+	for (unordered_map<unsigned int, char*>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+		free(it->second);
+	}
+	nodes.clear();
+	dirty.clear();
+	nodes[root] = (char*)calloc(cluster_size, 1);
+	btree_header* header = (btree_header*)nodes[root];
+	header->magic = BTREE_MAGIC;
+	header->leaf = 1;
+	dirty.insert(root);
+}
+
+void btree::load(unsigned int cluster, const char* data) {
+	if (nodes.count(cluster) == 0) nodes[cluster] = (char*)malloc(cluster_size);
+	memcpy(nodes[cluster], data, cluster_size);
+}
+
+bool btree::find(const char* name, unsigned long long &value) {
+	btree_header* header = node(root);
+	for (int depth = 0; header != NULL && depth < MAX_DEPTH; depth++) {
+		if (!header->leaf) {
+			header = node(child(header, name));
+			continue;
+		}
+		unsigned int i = search(header, name);
+		if (i == header->count || strcmp(keys(header)[i].name, name) != 0) return false;
+		value = keys(header)[i].value;
+		return true;
+	}
+	return false;
+}
+
+bool btree::insert(const char* name, unsigned long long value) {
+	btree_header* header = node(root);
+	if (header == NULL || strlen(name) >= sizeof(((btree_key*)0)->name)) return false;
+	// A full root is moved into a new node and becomes its only parent, so
+	// it can be split like any other node
+	if (header->count == capacity) {
+		int moved = allocate(context, root);
+		if (moved == -1) return false;
+		nodes[moved] = (char*)malloc(cluster_size);
+		memcpy(nodes[moved], header, cluster_size);
+		memset(header, 0, cluster_size);
+		header->magic = BTREE_MAGIC;
+		header->leaf = 0;
+		header->first = moved;
+		dirty.insert(root);
+		dirty.insert(moved);
+	}
+	unsigned int cluster = root;
+	for (int depth = 0; depth < MAX_DEPTH; depth++) {
+		header = node(cluster);
+		if (header == NULL) return false;
+		btree_key* key = keys(header);
+		if (header->leaf) {
+			unsigned int i = search(header, name);
+			if (i == header->count || strcmp(key[i].name, name) != 0) {
+				memmove(key + i + 1, key + i, (header->count - i) * sizeof(btree_key));
+				memset(&key[i], 0, sizeof(btree_key));
+				strcpy(key[i].name, name);
+				header->count++;
+			}
+			key[i].value = value;
+			dirty.insert(cluster);
+			return true;
+		}
+		unsigned int next = child(header, name);
+		btree_header* next_header = node(next);
+		if (next_header == NULL) return false;
+		// Split a full child before going into it; the name may then belong
+		// in the new node, so this node is looked at again
+		if (next_header->count == capacity) {
+			if (!split(cluster, next)) return false;
+			continue;
+		}
+		cluster = next;
+	}
+	return false;
+}
+
+bool btree::erase(const char* name) {
+	unsigned int cluster = root;
+	for (int depth = 0; depth < MAX_DEPTH; depth++) {
+		btree_header* header = node(cluster);
+		if (header == NULL) return false;
+		if (!header->leaf) {
+			cluster = child(header, name);
+			continue;
+		}
+		btree_key* key = keys(header);
+		unsigned int i = search(header, name);
+		if (i == header->count || strcmp(key[i].name, name) != 0) return false;
+		memmove(key + i, key + i + 1, (header->count - i - 1) * sizeof(btree_key));
+		header->count--;
+		memset(&key[header->count], 0, sizeof(btree_key));
+		dirty.insert(cluster);
+		return true;
+	}
+	return false;
+}
+
+void btree::list(vector<unsigned long long> &values) {
+	listFrom(root, values, 0);
+}
+
+bool btree::empty() {
+	return emptyFrom(root, 0);
+}
+
+void btree::getDirty(vector<unsigned int> &clusters) {
+	clusters.insert(clusters.end(), dirty.begin(), dirty.end());
+}
+
+void btree::clearDirty() {
+	dirty.clear();
+}
+
+char* btree::nodeAddress(unsigned int cluster) {
+	unordered_map<unsigned int, char*>::iterator it = nodes.find(cluster);
+	if (it == nodes.end()) return NULL;
+	return it->second;
+}
+
+unsigned int btree::getRoot() {
+	return root;
+}
+
+btree_header* btree::node(unsigned int cluster) {
+	unordered_map<unsigned int, char*>::iterator it = nodes.find(cluster);
+	if (it == nodes.end()) return NULL;
+	btree_header* header = (btree_header*)it->second;
+	if (header->magic != BTREE_MAGIC || header->count > capacity) return NULL;
+	return header;
+}
+
+btree_key* btree::keys(btree_header* header) {
+	return (btree_key*)(header + 1);
+}
+
+unsigned int btree::search(btree_header* header, const char* name) {
+	btree_key* key = keys(header);
+	unsigned int low = 0;
+	unsigned int high = header->count;
+	while (low < high) {
+		unsigned int middle = (low + high) / 2;
+		if (strcmp(key[middle].name, name) < 0) low = middle + 1;
+		else high = middle;
+	}
+	return low;
+}
+
+unsigned int btree::child(btree_header* header, const char* name) {
+	btree_key* key = keys(header);
+	unsigned int i = search(header, name);
+	if (i < header->count && strcmp(key[i].name, name) == 0) return key[i].value;
+	if (i == 0) return header->first;
+	return key[i - 1].value;
+}
+
+bool btree::split(unsigned int parent, unsigned int full) {
+	int right = allocate(context, root);
+	if (right == -1) return false;
+	nodes[right] = (char*)calloc(cluster_size, 1);
+	btree_header* left_header = node(full);
+	btree_header* right_header = (btree_header*)nodes[right];
+	btree_key* left_key = keys(left_header);
+	btree_key* right_key = keys(right_header);
+	right_header->magic = BTREE_MAGIC;
+	right_header->leaf = left_header->leaf;
+	unsigned int half = left_header->count / 2;
+	btree_key separator = left_key[half];
+	separator.value = right;
+	// A leaf keeps every name, so the separator is copied up; in an inner
+	// node it moves up and its child becomes the new node's first
+	unsigned int from = half;
+	if (!left_header->leaf) {
+		right_header->first = left_key[half].value;
+		from++;
+	}
+	right_header->count = left_header->count - from;
+	memcpy(right_key, left_key + from, right_header->count * sizeof(btree_key));
+	memset(left_key + half, 0, (left_header->count - half) * sizeof(btree_key));
+	left_header->count = half;
+	btree_header* parent_header = node(parent);
+	btree_key* parent_key = keys(parent_header);
+	unsigned int i = search(parent_header, separator.name);
+	memmove(parent_key + i + 1, parent_key + i, (parent_header->count - i) * sizeof(btree_key));
+	parent_key[i] = separator;
+	parent_header->count++;
+	dirty.insert(parent);
+	dirty.insert(full);
+	dirty.insert(right);
+	return true;
+}
+
+void btree::listFrom(unsigned int cluster, vector<unsigned long long> &values, int depth) {
+	btree_header* header = node(cluster);
+	if (header == NULL || depth >= MAX_DEPTH) return;
+	btree_key* key = keys(header);
+	if (header->leaf) {
+		for (unsigned int i = 0; i < header->count; i++) values.push_back(key[i].value);
+		return;
+	}
+	listFrom(header->first, values, depth + 1);
+	for (unsigned int i = 0; i < header->count; i++) listFrom(key[i].value, values, depth + 1);
+}
+
+bool btree::emptyFrom(unsigned int cluster, int depth) {
+	btree_header* header = node(cluster);
+	if (header == NULL || depth >= MAX_DEPTH) return true;
+	if (header->leaf) return header->count == 0;
+	if (!emptyFrom(header->first, depth + 1)) return false;
+	btree_key* key = keys(header);
+	for (unsigned int i = 0; i < header->count; i++) {
+		if (!emptyFrom(key[i].value, depth + 1)) return false;
+	}
+	return true;
+}
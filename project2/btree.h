@@ -0,0 +1,91 @@
+/*	File: btree.h
+	Author: Liam Morris
+	Description: Blueprints a B-tree of file names kept in clusters of the
+		     image, used as the on-disk index of a large directory.
+*/
+#ifndef BTREE_H
+#define BTREE_H
+#include <set>
+#include <vector>
+#include <unordered_map>
+
+// Every node is one cluster: a header, then keys sorted by name. Leaves map
+// each name to the absolute index of its directory entry. In inner nodes,
+// names before the first key are under the child named by first, and each
+// key leads to the child holding the names from it up to the next key.
+typedef struct {
+	unsigned int magic;
+	unsigned int leaf;
+	unsigned int count;
+	unsigned int first;
+} btree_header;
+
+typedef struct {
+	char name[112];
+	unsigned long long value;
+	unsigned long long reserved;
+} btree_key;
+
+class btree {
+public:
+	// constructor
+	// cluster_size - the size of a node
+	// root - cluster of the root node; the root never moves, so whatever
+	//        refers to the tree only needs to know this cluster
+	// allocate - called with context and the root to get a free cluster for
+	//            a new node, returns -1 if there are none
+	// context - passed on to allocate, such as the volume the tree is in
+	btree(unsigned int cluster_size, unsigned int root, int (*allocate)(void* context, unsigned int root), void* context);
+
+	// destructor - the nodes need to be cleaned up
+	~btree();
+
+	// makes the root an empty leaf and forgets every other node
+	void format();
+
+	// loads a node from its cluster in the image
+	void load(unsigned int cluster, const char* data);
+
+	// looks a name up; returns false if it isn't there
+	bool find(const char* name, unsigned long long &value);
+
+	// adds a name or changes its value; returns false if a node was needed
+	// and couldn't be allocated, in which case the tree is left as it was
+	bool insert(const char* name, unsigned long long value);
+
+	// removes a name; returns false if it wasn't there. Nodes aren't merged
+	// as they empty, so the tree never gets shorter.
+	bool erase(const char* name);
+
+	// gets every value, in name order
+	void list(std::vector<unsigned long long> &values);
+	bool empty();
+
+	// the nodes that have changed since clearDirty, and their contents
+	void getDirty(std::vector<unsigned int> &clusters);
+	void clearDirty();
+	char* nodeAddress(unsigned int cluster);
+	unsigned int getRoot();
+
+private:
+	// returns NULL for clusters that aren't loaded or aren't nodes
+	btree_header* node(unsigned int cluster);
+	btree_key* keys(btree_header* header);
+	// position of the first key in a node that isn't less than name
+	unsigned int search(btree_header* header, const char* name);
+	// the child of an inner node that name belongs under
+	unsigned int child(btree_header* header, const char* name);
+	// moves the upper half of a full child into a new node
+	bool split(unsigned int parent, unsigned int full);
+	void listFrom(unsigned int cluster, std::vector<unsigned long long> &values, int depth);
+	bool emptyFrom(unsigned int cluster, int depth);
+
+	unsigned int cluster_size;
+	unsigned int root;
+	unsigned int capacity;
+	int (*allocate)(void* context, unsigned int root);
+	void* context;
+	std::unordered_map<unsigned int, char*> nodes;
+	std::set<unsigned int> dirty;
+};
+#endif
@@ -0,0 +1,65 @@
+/*	File: cache.cpp
+	Author: Liam Morris
+	Description: Implements the cluster cache described in cache.h.
+*/
+
+#include "cache.h"
+
+cluster_cache::cluster_cache(int capacity, void (*release)(void* context, int index), void* context)
+	: release(release), context(context), capacity(capacity), hits(0), misses(0) { }
+
+bool cluster_cache::access(int index) {
+	std::unordered_map<int, std::list<int>::iterator>::iterator it = where.find(index);
+	// On a hit, move the cluster to the front
+	if (it != where.end()) {
+		order.splice(order.begin(), order, it->second);
+		hits++;
+		return true;
+	}
+	misses++;
+	order.push_front(index);
+	where[index] = order.begin();
+	trim();
+	return false;
+}
+
+void cluster_cache::insert(int index) {
+	if (where.find(index) != where.end()) return;
+	order.push_front(index);
+	where[index] = order.begin();
+	trim();
+}
+
+bool cluster_cache::contains(int index) {
+	return where.find(index) != where.end();
+}
+
+void cluster_cache::setCapacity(int capacity) {
+	this->capacity = capacity;
+	trim();
+}
+
+void cluster_cache::trim() {
+	while (!order.empty() && (int)order.size() > capacity) {
+		int index = order.back();
+		order.pop_back();
+		where.erase(index);
+		release(context, index);
+	}
+}
+
+int cluster_cache::getCapacity() {
+	return capacity;
+}
+
+int cluster_cache::getCount() {
+	return order.size();
+}
+
+int cluster_cache::getHits() {
+	return hits;
+}
+
+int cluster_cache::getMisses() {
+	return misses;
+}
@@ -0,0 +1,50 @@
+/*	File: cache.h
+	Author: Liam Morris
+	Description: Blueprints a fixed-size cache of cluster indices with least
+		     recently used eviction, used to keep hot clusters resident.
+*/
+#ifndef CACHE_H
+#define CACHE_H
+#include <list>
+#include <unordered_map>
+
+// Keeps track of which clusters are cached, most recently used first. The
+// cache doesn't hold the data itself; whoever owns it is told through the
+// release function when a cluster is pushed out so it can let go of it.
+class cluster_cache {
+public:
+	// constructor
+	// capacity - the most clusters that are cached at once
+	// release - called with context and each cluster that is evicted
+	// context - passed on to release, such as the volume being cached
+	cluster_cache(int capacity, void (*release)(void* context, int index), void* context);
+
+	// records a read or write of a cluster and makes it the most recently
+	// used; returns true if it was already cached
+	bool access(int index);
+
+	// adds a cluster that was read ahead; it isn't counted as a hit or a miss
+	void insert(int index);
+
+	bool contains(int index);
+
+	// changes the capacity, evicting clusters if it shrank
+	void setCapacity(int capacity);
+	int getCapacity();
+	int getCount();
+	int getHits();
+	int getMisses();
+
+private:
+	// evicts least recently used clusters until the cache fits its capacity
+	void trim();
+
+	std::list<int> order;
+	std::unordered_map<int, std::list<int>::iterator> where;
+	void (*release)(void* context, int index);
+	void* context;
+	int capacity;
+	int hits;
+	int misses;
+};
+#endif
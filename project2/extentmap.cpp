@@ -0,0 +1,78 @@
+/*	File: extentmap.cpp
+	Author: Liam Morris
+	Description: Implements the extent map described in extentmap.h.
+*/
+#include "extentmap.h"
+
+using namespace std;
+
+extent_map::extent_map(unsigned int start, const unsigned int* FAT, const unsigned int* refs, unsigned int num_clusters) {
+	length = 0;
+	shared = -1;
+	follow(start, FAT, refs, num_clusters);
+}
+
+void extent_map::extend(const unsigned int* FAT, const unsigned int* refs, unsigned int num_clusters) {
+	if (extents.empty()) return;
+	unsigned int last = extents.back().start + extents.back().length - 1;
+	follow(FAT[last], FAT, refs, num_clusters);
+}
+
+int extent_map::lookup(unsigned int position) {
+	int i = find(position);
+	if (i == -1) return -1;
+	return extents[i].start + (position - extents[i].position);
+}
+
+void extent_map::runs(unsigned int position, unsigned int count, vector<cluster_extent> &found) {
+	int i = find(position);
+	if (i == -1) return;
+	// Only the first run can start part way in
+	unsigned int skip = position - extents[i].position;
+	for (; (size_t)i < extents.size() && count > 0; i++) {
+		cluster_extent run = { extents[i].start + skip, extents[i].length - skip };
+		if (run.length > count) run.length = count;
+		found.push_back(run);
+		count -= run.length;
+		skip = 0;
+	}
+}
+
+unsigned int extent_map::getLength() {
+	return length;
+}
+
+unsigned int extent_map::getRuns() {
+	return extents.size();
+}
+
+int extent_map::getShared() {
+	return shared;
+}
+
+void extent_map::follow(unsigned int cur_index, const unsigned int* FAT, const unsigned int* refs, unsigned int num_clusters) {
+	while (cur_index != 0x0000 && cur_index != 0xFFFF && cur_index < num_clusters && length < num_clusters) {
+		if (!extents.empty() && extents.back().start + extents.back().length == cur_index) {
+			extents.back().length++;
+		} else {
+			file_extent run = { length, cur_index, 1 };
+			extents.push_back(run);
+		}
+		if (shared == -1 && refs[cur_index] > 1) shared = length;
+		length++;
+		cur_index = FAT[cur_index];
+	}
+}
+
+int extent_map::find(unsigned int position) {
+	if (position >= length) return -1;
+	// The last run that starts at or before position
+	int low = 0;
+	int high = extents.size() - 1;
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+		if (extents[middle].position <= position) low = middle;
+		else high = middle - 1;
+	}
+	return low;
+}
@@ -0,0 +1,61 @@
+/*	File: extentmap.h
+	Author: Liam Morris
+	Description: Blueprints a map of where each part of a file is in the
+		     image, kept as runs of clusters so it can be searched
+		     instead of following the file's chain link by link.
+*/
+#ifndef EXTENTMAP_H
+#define EXTENTMAP_H
+#include <vector>
+#include "bitmap.h"
+
+// A run of consecutive clusters of a file and the cluster of the file it
+// starts at (0 is the first)
+typedef struct {
+	unsigned int position;
+	unsigned int start;
+	unsigned int length;
+} file_extent;
+
+class extent_map {
+public:
+	// constructor - follows the file's chain through the FAT once
+	// start - the first cluster of the file
+	// FAT - the file allocation table
+	// refs - the number of references to each cluster
+	// num_clusters - number of entries in the FAT; a chain that leaves the
+	//                table, reaches a free cluster or gets longer than this
+	//                is taken to end there
+	extent_map(unsigned int start, const unsigned int* FAT, const unsigned int* refs, unsigned int num_clusters);
+
+	// follows the chain on from the last cluster in the map, if clusters
+	// have been added to the end of it since the map was made
+	void extend(const unsigned int* FAT, const unsigned int* refs, unsigned int num_clusters);
+
+	// returns the cluster that holds a cluster of the file, -1 past its end
+	int lookup(unsigned int position);
+
+	// appends the runs that hold count clusters of the file, starting at
+	// position, in file order; stops early at the end of the file
+	void runs(unsigned int position, unsigned int count, std::vector<cluster_extent> &found);
+
+	// number of clusters in the file and number of runs they make up
+	unsigned int getLength();
+	unsigned int getRuns();
+
+	// the first cluster of the file that something else also refers to, so
+	// it and the rest of the chain are shared with another file; -1 if the
+	// whole chain is the file's own
+	int getShared();
+
+private:
+	// index of the run that holds a cluster of the file, -1 past its end
+	int find(unsigned int position);
+	// adds the chain from a cluster on to the end of the map
+	void follow(unsigned int cur_index, const unsigned int* FAT, const unsigned int* refs, unsigned int num_clusters);
+
+	std::vector<file_extent> extents;
+	unsigned int length;
+	int shared;
+};
+#endif
@@ -0,0 +1,629 @@
+/*	File: fatfuse.cpp
+	Author: Liam Morris
+	Description: Mounts a file system image as a real file system through
+		     FUSE. Requests are read straight from /dev/fuse by a pool of
+		     worker threads and answered by one volume from libfat.a,
+		     which takes any number of calls at once. The image is
+		     mounted with mount(2) itself rather than through
+		     fusermount, so the daemon has to run as root.
+*/
+
+#include "fatfuse.h"
+#include "volume.h"
+#include <iostream>
+#include <unordered_map>
+#include <unistd.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <cstdlib>
+#include <pthread.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+
+using namespace std;
+
+// Most bytes moved by one read or write request. Each worker's request
+// buffer holds a write this big along with its headers.
+const int MAX_TRANSFER = 128 * 1024;
+const int REQUEST_BUFFER = MAX_TRANSFER + 4096;
+
+// Most worker threads the daemon starts
+const int MAX_WORKERS = 16;
+
+// How long, in seconds, the kernel may keep names and attributes it has
+// been given before asking again
+const int ATTR_TIMEOUT = 1;
+
+// Inode number given to "." and "..", which the kernel doesn't look at
+const uint64_t UNKNOWN_INO = 0xFFFFFFFF;
+
+// The mounted image, and the path its root has inside it, which is where
+// it is mounted on the host
+volume* fs;
+string root_path;
+char mount_point[PATH_MAX];
+int fuse_fd;
+
+// Nodes the kernel knows about, by node id and by path. Node 1 is the root.
+unordered_map<uint64_t, fuse_node> nodes;
+unordered_map<string, uint64_t> node_ids;
+uint64_t next_node;
+pthread_mutex_t node_lock;
+
+int main(int argc, char** argv) {
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	bool use_splice = true;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:n")) != -1) {
+		if (opt == 't') workers = atoi(optarg);
+		else if (opt == 'n') use_splice = false;
+		else break;
+	}
+	if (opt != -1 || argc - optind != 2 || workers < 1) {
+		cerr << "usage: " << argv[0] << " [-t threads] [-n] image mount_point" << endl;
+		cerr << "\t-t threads - number of threads that answer requests" << endl;
+		cerr << "\t-n - copy the data of reads instead of splicing it" << endl;
+		cerr << "Mounting needs root (CAP_SYS_ADMIN)." << endl;
+		return 1;
+	}
+	if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+	const char* image = argv[optind];
+	if (realpath(argv[optind + 1], mount_point) == NULL) {
+		cerr << "Mount point '" << argv[optind + 1] << "' does not exist." << endl;
+		return 1;
+	}
+	root_path = mount_point;
+	fs = new volume();
+	if (!fs->mountImage(image, root_path)) {
+		cerr << "Unable to mount file system '" << image << "'." << endl;
+		return 1;
+	}
+
+	// Mount the image on the host, with /dev/fuse as the way requests come in
+	fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fuse_fd == -1) {
+		perror("/dev/fuse");
+		fs->unmount();
+		return 1;
+	}
+	char options[256];
+	snprintf(options, sizeof(options), "fd=%d,rootmode=%o,user_id=%u,group_id=%u,max_read=%d,default_permissions%s",
+		 fuse_fd, S_IFDIR, getuid(), getgid(), MAX_TRANSFER, getuid() == 0 ? ",allow_other" : "");
+	if (mount(image, mount_point, "fuse.fatfuse", MS_NOSUID | MS_NODEV, options) == -1) {
+		perror("mount");
+		if (errno == EPERM) cerr << "Mounting needs root (CAP_SYS_ADMIN)." << endl;
+		close(fuse_fd);
+		fs->unmount();
+		return 1;
+	}
+
+	pthread_mutex_init(&node_lock, NULL);
+	fuse_node root = { root_path, 1 };
+	nodes[FUSE_ROOT_ID] = root;
+	node_ids[root_path] = FUSE_ROOT_ID;
+	next_node = FUSE_ROOT_ID + 1;
+
+	// Stopping the daemon unmounts the image, which wakes up the workers
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stopDaemon;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	// Each worker splices through pipes of its own. Pipes that can't hold a
+	// whole reply mean reads are copied instead.
+	vector<pthread_t> threads(workers);
+	vector<splice_pipes> pipes(workers);
+	for (int i = 0; i < workers && use_splice; i++) {
+		if (pipe2(pipes[i].data, O_CLOEXEC) == -1 || pipe2(pipes[i].reply, O_CLOEXEC) == -1 ||
+		    fcntl(pipes[i].data[1], F_SETPIPE_SZ, 2 * MAX_TRANSFER) == -1 ||
+		    fcntl(pipes[i].reply[1], F_SETPIPE_SZ, 2 * MAX_TRANSFER) == -1) {
+			cerr << "Unable to set up splicing, reads will be copied." << endl;
+			use_splice = false;
+		}
+	}
+	cout << "Mounted " << image << " on " << mount_point << " with " << workers << " threads";
+	cout << (use_splice ? ", splicing reads." : ".") << endl;
+	for (int i = 0; i < workers; i++) {
+		pthread_create(&threads[i], NULL, serveRequests, use_splice ? &pipes[i] : NULL);
+	}
+	for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+	for (int i = 0; i < workers && use_splice; i++) {
+		close(pipes[i].data[0]);
+		close(pipes[i].data[1]);
+		close(pipes[i].reply[0]);
+		close(pipes[i].reply[1]);
+	}
+	close(fuse_fd);
+	fs->unmount();
+	delete fs;
+	pthread_mutex_destroy(&node_lock);
+	return 0;
+}
+
+/* Unmounts the image. The kernel then ends the connection, and the
+ * workers see that on their next read of /dev/fuse. Any of the signals
+ * it is set up for does the same, so which one was caught doesn't matter.
+ */
+void stopDaemon(int) {
+	umount2(mount_point, MNT_DETACH);
+}
+
+/* Reads requests from /dev/fuse and answers them until the image is
+ * unmounted. Any number of workers can read at once; each read gets one
+ * whole request.
+ * void* arg - the worker's splice_pipes, or NULL if reads are copied
+ */
+void* serveRequests(void* arg) {
+	splice_pipes* pipes = (splice_pipes*)arg;
+	char* request = (char*)malloc(REQUEST_BUFFER);
+	char* scratch = (char*)malloc(REQUEST_BUFFER);
+	while (true) {
+		ssize_t length = read(fuse_fd, request, REQUEST_BUFFER);
+		if (length == -1) {
+			// Interrupted, or the request was taken back before it was read
+			if (errno == EINTR || errno == EAGAIN || errno == ENOENT) continue;
+			// ENODEV means the image was unmounted
+			if (errno != ENODEV) perror("/dev/fuse");
+			break;
+		}
+		if ((size_t)length < sizeof(struct fuse_in_header)) continue;
+		handleRequest(request, scratch, pipes);
+	}
+	free(request);
+	free(scratch);
+	return NULL;
+}
+
+/* Answers one request with the volume. Names in a request come after its
+ * header and its fixed part, and end in a null.
+ * char* request - the request, header first
+ * char* scratch - a buffer as big as the biggest request
+ * splice_pipes* pipes - the worker's pipes, or NULL if reads are copied
+ */
+void handleRequest(char* request, char* scratch, splice_pipes* pipes) {
+	struct fuse_in_header* header = (struct fuse_in_header*)request;
+	char* body = request + sizeof(struct fuse_in_header);
+	uint64_t unique = header->unique;
+	int error = 0;
+	// Requests that name a node the kernel no longer has a path for
+	string path = nodePath(header->nodeid);
+
+	switch (header->opcode) {
+	case FUSE_INIT: {
+		struct fuse_init_in* in = (struct fuse_init_in*)body;
+		if (in->major != FUSE_KERNEL_VERSION) {
+			reply(unique, EPROTO, NULL, 0);
+			break;
+		}
+		struct fuse_init_out out;
+		memset(&out, 0, sizeof(out));
+		out.major = FUSE_KERNEL_VERSION;
+		out.minor = (in->minor < FUSE_KERNEL_MINOR_VERSION) ? in->minor : FUSE_KERNEL_MINOR_VERSION;
+		out.max_readahead = in->max_readahead;
+		// The volume takes any number of reads, and lookups in one
+		// directory, at once
+		out.flags = in->flags & (FUSE_ASYNC_READ | FUSE_BIG_WRITES | FUSE_PARALLEL_DIROPS);
+		out.max_background = 64;
+		out.congestion_threshold = 48;
+		out.max_write = MAX_TRANSFER;
+		// Times are kept to the second
+		out.time_gran = 1000000000;
+		reply(unique, 0, &out, (out.minor < 23) ? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+		break;
+	}
+	case FUSE_DESTROY:
+		reply(unique, 0, NULL, 0);
+		break;
+	case FUSE_FORGET:
+		forgetNode(header->nodeid, ((struct fuse_forget_in*)body)->nlookup);
+		break;
+	case FUSE_BATCH_FORGET: {
+		struct fuse_batch_forget_in* in = (struct fuse_batch_forget_in*)body;
+		struct fuse_forget_one* forgets = (struct fuse_forget_one*)(in + 1);
+		for (uint32_t i = 0; i < in->count; i++) forgetNode(forgets[i].nodeid, forgets[i].nlookup);
+		break;
+	}
+	case FUSE_INTERRUPT:
+		// Requests are quick, so they are left to finish
+		break;
+	case FUSE_LOOKUP: {
+		struct fuse_entry_out out;
+		error = path.empty() ? ENOENT : fillEntry(path + "/" + body, &out);
+		reply(unique, error, &out, sizeof(out));
+		break;
+	}
+	case FUSE_GETATTR:
+	case FUSE_SETATTR: {
+		if (header->opcode == FUSE_SETATTR && !path.empty()) {
+			// Only the size is kept; the image has no owners, modes or
+			// times other than when a file was made
+			struct fuse_setattr_in* in = (struct fuse_setattr_in*)body;
+			if (in->valid & FATTR_SIZE) {
+				int fd = (in->valid & FATTR_FH) ? in->fh : fs->fs_open(path.c_str(), O_WRONLY);
+				if (fd == -1 || fs->fs_truncate(fd, in->size) == -1) error = errno;
+				if (fd != -1 && !(in->valid & FATTR_FH)) fs->fs_close(fd);
+			}
+		}
+		struct stat st;
+		if (error == 0 && (path.empty() || fs->fs_stat(path.c_str(), &st) == -1)) error = path.empty() ? ENOENT : errno;
+		struct fuse_attr_out out;
+		memset(&out, 0, sizeof(out));
+		out.attr_valid = ATTR_TIMEOUT;
+		if (error == 0) fillAttr(&st, &out.attr);
+		reply(unique, error, &out, sizeof(out));
+		break;
+	}
+	case FUSE_OPEN: {
+		struct fuse_open_in* in = (struct fuse_open_in*)body;
+		struct fuse_open_out out;
+		memset(&out, 0, sizeof(out));
+		int fd = path.empty() ? -1 : fs->fs_open(path.c_str(), in->flags & (O_ACCMODE | O_TRUNC));
+		if (fd == -1) error = path.empty() ? ENOENT : errno;
+		out.fh = fd;
+		reply(unique, error, &out, sizeof(out));
+		break;
+	}
+	case FUSE_CREATE:
+	case FUSE_MKNOD: {
+		// A file is made with fs_open either way; mknod only makes files
+		struct {
+			struct fuse_entry_out entry;
+			struct fuse_open_out open;
+		} out;
+		memset(&out, 0, sizeof(out));
+		int flags = O_RDWR | O_EXCL;
+		const char* name;
+		if (header->opcode == FUSE_CREATE) {
+			struct fuse_create_in* in = (struct fuse_create_in*)body;
+			flags = in->flags & (O_ACCMODE | O_TRUNC | O_EXCL);
+			name = (const char*)(in + 1);
+		} else {
+			struct fuse_mknod_in* in = (struct fuse_mknod_in*)body;
+			if (!S_ISREG(in->mode)) error = EPERM;
+			name = (const char*)(in + 1);
+		}
+		string child = path + "/" + name;
+		int fd = -1;
+		if (error == 0 && path.empty()) error = ENOENT;
+		if (error == 0 && (fd = fs->fs_open(child.c_str(), flags | O_CREAT)) == -1) error = errno;
+		if (error == 0) error = fillEntry(child, &out.entry);
+		if (header->opcode == FUSE_MKNOD && fd != -1) fs->fs_close(fd);
+		if (header->opcode == FUSE_CREATE && error != 0 && fd != -1) fs->fs_close(fd);
+		out.open.fh = fd;
+		if (header->opcode == FUSE_CREATE) reply(unique, error, &out, sizeof(out));
+		else reply(unique, error, &out.entry, sizeof(out.entry));
+		break;
+	}
+	case FUSE_READ:
+		replyRead(unique, (struct fuse_read_in*)body, scratch, pipes);
+		break;
+	case FUSE_WRITE: {
+		struct fuse_write_in* in = (struct fuse_write_in*)body;
+		struct fuse_write_out out;
+		memset(&out, 0, sizeof(out));
+		ssize_t count = fs->fs_pwrite(in->fh, (const char*)(in + 1), in->size, in->offset);
+		if (count == -1) error = errno;
+		else out.size = count;
+		reply(unique, error, &out, sizeof(out));
+		break;
+	}
+	case FUSE_RELEASE:
+		fs->fs_close(((struct fuse_release_in*)body)->fh);
+		reply(unique, 0, NULL, 0);
+		break;
+	case FUSE_FLUSH:
+		reply(unique, 0, NULL, 0);
+		break;
+	case FUSE_FSYNC:
+	case FUSE_FSYNCDIR:
+		fs->syncImage();
+		reply(unique, 0, NULL, 0);
+		break;
+	case FUSE_OPENDIR: {
+		// The listing is taken when the directory is opened, and again
+		// when it is rewound, so the offsets handed out stay put
+		vector<struct dirent>* entries = new vector<struct dirent>();
+		if (path.empty() || fs->fs_readdir(path.c_str(), *entries) == -1) {
+			error = path.empty() ? ENOENT : errno;
+			delete entries;
+			entries = NULL;
+		}
+		struct fuse_open_out out;
+		memset(&out, 0, sizeof(out));
+		out.fh = (uint64_t)entries;
+		reply(unique, error, &out, sizeof(out));
+		break;
+	}
+	case FUSE_READDIR: {
+		struct fuse_read_in* in = (struct fuse_read_in*)body;
+		vector<struct dirent>* entries = (vector<struct dirent>*)in->fh;
+		if (in->offset == 0) {
+			entries->clear();
+			if (!path.empty()) fs->fs_readdir(path.c_str(), *entries);
+		}
+		// "." and ".." come first, at offsets 0 and 1
+		size_t length = 0;
+		for (uint64_t i = in->offset; i < entries->size() + 2; i++) {
+			const char* name = (i == 0) ? "." : (i == 1) ? ".." : (*entries)[i - 2].d_name;
+			struct fuse_dirent* dirent = (struct fuse_dirent*)(scratch + length);
+			size_t size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + strlen(name));
+			if (length + size > in->size) break;
+			dirent->ino = (i < 2) ? UNKNOWN_INO : (*entries)[i - 2].d_ino;
+			dirent->off = i + 1;
+			dirent->namelen = strlen(name);
+			dirent->type = (i < 2) ? (unsigned char)DT_DIR : (*entries)[i - 2].d_type;
+			memset(dirent->name, 0, size - FUSE_NAME_OFFSET);
+			memcpy(dirent->name, name, dirent->namelen);
+			length += size;
+		}
+		reply(unique, 0, scratch, length);
+		break;
+	}
+	case FUSE_RELEASEDIR:
+		delete (vector<struct dirent>*)((struct fuse_release_in*)body)->fh;
+		reply(unique, 0, NULL, 0);
+		break;
+	case FUSE_MKDIR: {
+		string child = path + "/" + (const char*)((struct fuse_mkdir_in*)body + 1);
+		struct fuse_entry_out out;
+		if (path.empty()) error = ENOENT;
+		else if (fs->fs_mkdir(child.c_str()) == -1) error = errno;
+		else error = fillEntry(child, &out);
+		reply(unique, error, &out, sizeof(out));
+		break;
+	}
+	case FUSE_UNLINK:
+	case FUSE_RMDIR: {
+		string child = path + "/" + body;
+		if (path.empty()) error = ENOENT;
+		else if (header->opcode == FUSE_UNLINK && fs->fs_unlink(child.c_str()) == -1) error = errno;
+		else if (header->opcode == FUSE_RMDIR && fs->fs_rmdir(child.c_str()) == -1) error = errno;
+		else dropNode(child);
+		reply(unique, error, NULL, 0);
+		break;
+	}
+	case FUSE_RENAME:
+	case FUSE_RENAME2: {
+		uint64_t new_dir;
+		uint32_t flags = 0;
+		const char* name;
+		if (header->opcode == FUSE_RENAME) {
+			new_dir = ((struct fuse_rename_in*)body)->newdir;
+			name = (const char*)((struct fuse_rename_in*)body + 1);
+		} else {
+			new_dir = ((struct fuse_rename2_in*)body)->newdir;
+			flags = ((struct fuse_rename2_in*)body)->flags;
+			name = (const char*)((struct fuse_rename2_in*)body + 1);
+		}
+		string from = path + "/" + name;
+		string new_path = nodePath(new_dir);
+		string to = new_path + "/" + (name + strlen(name) + 1);
+		// Entries can only be moved over files, not swapped
+		bool replace = !(flags & RENAME_NOREPLACE);
+		if (flags & ~RENAME_NOREPLACE) error = EINVAL;
+		else if (path.empty() || new_path.empty()) error = ENOENT;
+		else if (fs->fs_rename(from.c_str(), to.c_str(), replace) == -1) error = errno;
+		else moveNodes(from, to);
+		reply(unique, error, NULL, 0);
+		break;
+	}
+	case FUSE_STATFS: {
+		struct fuse_statfs_out out;
+		memset(&out, 0, sizeof(out));
+		out.st.blocks = fs->getClusters();
+		out.st.bfree = out.st.bavail = fs->numAvailableClusters();
+		out.st.bsize = out.st.frsize = fs->getClusterSize();
+		out.st.namelen = sizeof(((directory_entry*)0)->name) - 1;
+		reply(unique, 0, &out, sizeof(out));
+		break;
+	}
+	default:
+		reply(unique, ENOSYS, NULL, 0);
+	}
+}
+
+/* Sends a reply to /dev/fuse, header first, in one write.
+ * uint64_t unique - the request being answered
+ * int error - 0, or the errno value of the error
+ * const void* data - the reply's body
+ * size_t length - the size of the body
+ */
+void reply(uint64_t unique, int error, const void* data, size_t length) {
+	struct fuse_out_header header;
+	header.unique = unique;
+	header.error = -error;
+	header.len = sizeof(header) + (error == 0 ? length : 0);
+	struct iovec iov[2];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = (void*)data;
+	iov[1].iov_len = length;
+	// ENOENT means the request was interrupted and nobody wants the reply
+	if (writev(fuse_fd, iov, (error == 0 && length > 0) ? 2 : 1) == -1 && errno != ENOENT) perror("/dev/fuse");
+}
+
+/* Empties a pipe after a splice that didn't go all the way.
+ * int fd - the read end of the pipe
+ * char* scratch - where what is left goes
+ */
+static void drainPipe(int fd, char* scratch) {
+	int left;
+	while (ioctl(fd, FIONREAD, &left) == 0 && left > 0) {
+		if (read(fd, scratch, left < REQUEST_BUFFER ? left : REQUEST_BUFFER) <= 0) break;
+	}
+}
+
+/* Replies to a read. With pipes, the file's pages are spliced from the image
+ * into the data pipe, moved behind the reply header in the reply pipe and
+ * spliced into /dev/fuse, so the bytes are never copied by the daemon.
+ * Without them, the bytes are read into scratch and written out from there.
+ * uint64_t unique - the request being answered
+ * struct fuse_read_in* in - what is read
+ * char* scratch - a buffer as big as the biggest request
+ * splice_pipes* pipes - the worker's pipes, or NULL
+ */
+void replyRead(uint64_t unique, struct fuse_read_in* in, char* scratch, splice_pipes* pipes) {
+	size_t size = (in->size < MAX_TRANSFER) ? in->size : MAX_TRANSFER;
+	if (pipes == NULL) {
+		ssize_t count = fs->fs_pread(in->fh, scratch, size, in->offset);
+		reply(unique, (count == -1) ? errno : 0, scratch, count);
+		return;
+	}
+	ssize_t count = fs->fs_splice(in->fh, pipes->data[1], size, in->offset);
+	if (count == -1) {
+		int error = errno;
+		drainPipe(pipes->data[0], scratch);
+		reply(unique, error, NULL, 0);
+		return;
+	}
+	struct fuse_out_header header;
+	header.unique = unique;
+	header.error = 0;
+	header.len = sizeof(header) + count;
+	bool sent = write(pipes->reply[1], &header, sizeof(header)) == sizeof(header);
+	for (ssize_t left = count; sent && left > 0; ) {
+		ssize_t moved = splice(pipes->data[0], NULL, pipes->reply[1], NULL, left, SPLICE_F_MOVE);
+		if (moved <= 0) sent = false;
+		else left -= moved;
+	}
+	// /dev/fuse takes the whole reply from a single splice
+	if (sent) {
+		ssize_t moved = splice(pipes->reply[0], NULL, fuse_fd, NULL, header.len, SPLICE_F_MOVE);
+		if (moved == header.len) return;
+		// The request was interrupted, or the kernel took part of the reply
+		if (moved == -1 && errno == ENOENT) {
+			drainPipe(pipes->reply[0], scratch);
+			return;
+		}
+	}
+	drainPipe(pipes->data[0], scratch);
+	drainPipe(pipes->reply[0], scratch);
+	reply(unique, EIO, NULL, 0);
+}
+
+/* Fills in a reply that names a node, and counts a lookup of the node.
+ * Returns 0, or the errno value of why the path can't be looked at.
+ * const string &path - the node's path
+ * struct fuse_entry_out* out - the reply being filled in
+ */
+int fillEntry(const string &path, struct fuse_entry_out* out) {
+	struct stat st;
+	memset(out, 0, sizeof(struct fuse_entry_out));
+	if (fs->fs_stat(path.c_str(), &st) == -1) return errno;
+	out->nodeid = addNode(path);
+	out->entry_valid = ATTR_TIMEOUT;
+	out->attr_valid = ATTR_TIMEOUT;
+	fillAttr(&st, &out->attr);
+	return 0;
+}
+
+/* Fills in the attributes the kernel is given from a stat.
+ * struct stat* st - the stat from the volume
+ * struct fuse_attr* attr - the attributes being filled in
+ */
+void fillAttr(struct stat* st, struct fuse_attr* attr) {
+	memset(attr, 0, sizeof(struct fuse_attr));
+	attr->ino = st->st_ino;
+	attr->size = st->st_size;
+	attr->blocks = st->st_blocks;
+	attr->atime = st->st_atime;
+	attr->mtime = st->st_mtime;
+	attr->ctime = st->st_ctime;
+	attr->mode = st->st_mode;
+	attr->nlink = st->st_nlink;
+	attr->uid = st->st_uid;
+	attr->gid = st->st_gid;
+	attr->blksize = st->st_blksize;
+}
+
+/* Gets a node's path, which is empty if the node's file was removed.
+ * uint64_t nodeid - the node
+ */
+string nodePath(uint64_t nodeid) {
+	pthread_mutex_lock(&node_lock);
+	unordered_map<uint64_t, fuse_node>::iterator it = nodes.find(nodeid);
+	string path = (it == nodes.end()) ? "" : it->second.path;
+	pthread_mutex_unlock(&node_lock);
+	return path;
+}
+
+/* Counts a lookup of the node with a path, making the node if the kernel
+ * doesn't know about one. Returns the node's id.
+ * const string &path - the path that was looked up
+ */
+uint64_t addNode(const string &path) {
+	pthread_mutex_lock(&node_lock);
+	uint64_t nodeid;
+	unordered_map<string, uint64_t>::iterator it = node_ids.find(path);
+	if (it != node_ids.end()) nodeid = it->second;
+	else {
+		nodeid = next_node++;
+		nodes[nodeid].path = path;
+		nodes[nodeid].lookups = 0;
+		node_ids[path] = nodeid;
+	}
+	nodes[nodeid].lookups++;
+	pthread_mutex_unlock(&node_lock);
+	return nodeid;
+}
+
+/* Takes back lookups of a node, dropping it once the kernel has forgotten it.
+ * uint64_t nodeid - the node
+ * uint64_t lookups - how many lookups the kernel forgot
+ */
+void forgetNode(uint64_t nodeid, uint64_t lookups) {
+	pthread_mutex_lock(&node_lock);
+	unordered_map<uint64_t, fuse_node>::iterator it = nodes.find(nodeid);
+	if (it != nodes.end() && nodeid != FUSE_ROOT_ID) {
+		if (it->second.lookups > lookups) it->second.lookups -= lookups;
+		else {
+			unordered_map<string, uint64_t>::iterator id = node_ids.find(it->second.path);
+			if (id != node_ids.end() && id->second == nodeid) node_ids.erase(id);
+			nodes.erase(it);
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+/* Takes the path away from the node that has it, after its file is removed.
+ * const string &path - the path of the removed file
+ */
+void dropNode(const string &path) {
+	pthread_mutex_lock(&node_lock);
+	unordered_map<string, uint64_t>::iterator it = node_ids.find(path);
+	if (it != node_ids.end()) {
+		nodes[it->second].path = "";
+		node_ids.erase(it);
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+/* Gives the nodes at and under a path that was renamed their new paths.
+ * A node that had the new path was replaced, so it loses its path.
+ * const string &from - the old path
+ * const string &to - the new path
+ */
+void moveNodes(const string &from, const string &to) {
+	dropNode(to);
+	pthread_mutex_lock(&node_lock);
+	vector<uint64_t> moved;
+	for (unordered_map<uint64_t, fuse_node>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+		string &path = it->second.path;
+		if (path == from || path.compare(0, from.length() + 1, from + "/") == 0) moved.push_back(it->first);
+	}
+	for (unsigned int i = 0; i < moved.size(); i++) {
+		string &path = nodes[moved[i]].path;
+		node_ids.erase(path);
+		path = to + path.substr(from.length());
+		node_ids[path] = moved[i];
+	}
+	pthread_mutex_unlock(&node_lock);
+}
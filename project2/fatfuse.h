@@ -0,0 +1,70 @@
+/*	File: fatfuse.h
+	Author: Liam Morris
+	Description: Defines the FUSE daemon that mounts a file system image as a
+		     real file system on the host, so any program can use it.
+*/
+#ifndef FATFUSE_H
+#define FATFUSE_H
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <linux/fuse.h>
+
+// A node the kernel has looked up, named by its path in the image. lookups
+// counts the lookups the kernel hasn't forgotten; the node is dropped once
+// it reaches 0. The path is emptied once the file is removed, so a new file
+// with the same path gets a node of its own.
+typedef struct {
+	std::string path;
+	uint64_t lookups;
+} fuse_node;
+
+// Pipes a worker splices replies to reads through. The file's pages are
+// spliced into data, and from there behind the reply header in reply, so the
+// whole reply can be spliced into /dev/fuse in one go.
+typedef struct {
+	int data[2];
+	int reply[2];
+} splice_pipes;
+
+// Mounts the image and serves requests until it is unmounted; it has to
+// run as root, since the image is mounted with mount(2) directly
+// usage: fatfuse [-t threads] [-n] image mount_point
+int main(int argc, char** argv);
+
+// Reads requests from /dev/fuse and answers them; one per worker thread
+void* serveRequests(void* arg);
+
+// Answers one request
+// char* request - the request, header first
+// char* scratch - a buffer as big as the biggest request
+// splice_pipes* pipes - the worker's pipes, or NULL if reads are copied
+void handleRequest(char* request, char* scratch, splice_pipes* pipes);
+
+// Replies to a request; nothing but the error is sent if there is one
+// uint64_t unique - the request being answered
+// int error - 0, or the errno value of the error
+// const void* data - the reply's body
+// size_t length - the size of the body
+void reply(uint64_t unique, int error, const void* data, size_t length);
+
+// Replies to a read, splicing the file's pages if pipes isn't NULL
+void replyRead(uint64_t unique, struct fuse_read_in* in, char* scratch, splice_pipes* pipes);
+
+// Fills in a reply that names a node, and counts a lookup of the node
+// Returns 0, or the errno value of why it couldn't
+int fillEntry(const std::string &path, struct fuse_entry_out* out);
+void fillAttr(struct stat* st, struct fuse_attr* attr);
+
+// The table of nodes
+std::string nodePath(uint64_t nodeid);
+uint64_t addNode(const std::string &path);
+void forgetNode(uint64_t nodeid, uint64_t lookups);
+void dropNode(const std::string &path);
+void moveNodes(const std::string &from, const std::string &to);
+
+// Unmounts the image when the daemon is told to stop
+void stopDaemon(int sig);
+#endif
@@ -29,7 +29,7 @@ void history::add(char* command) {
 	using namespace std;
 
 	// Create a new node and store the command
-	char* theCommand = new char[64];
+	char* theCommand = new char[strlen(command) + 1];
 	strcpy(theCommand, command);
 	node* newNode = new node(theCommand);
 
@@ -0,0 +1,324 @@
+/*	File: ioengine.cpp
+	Author: Liam Morris
+	Description: Implements the asynchronous I/O engine. The io_uring backend
+		     talks to the kernel through the raw system calls, so no extra
+		     library is needed; the thread pool backend is used whenever
+		     the ring can not be set up.
+*/
+#include "ioengine.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+using namespace std;
+
+const int IO_THREADS = 4;
+
+/* Transfers whatever is left of a request with plain pread/pwrite.
+ * io_request* request - the request to finish
+ * size_t done - how many bytes have already been transferred
+ */
+static void finishRequest(io_request* request, size_t done) {
+	while (done < request->length) {
+		ssize_t n;
+		if (request->op == IO_READ)
+			n = pread(request->fd, request->buffer + done, request->length - done,
+				  request->offset + done);
+		else
+			n = pwrite(request->fd, request->buffer + done, request->length - done,
+				   request->offset + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			request->result = done > 0 ? (ssize_t)done : -errno;
+			return;
+		}
+		if (n == 0) break;
+		done += n;
+	}
+	request->result = done;
+}
+
+io_engine::io_engine(int depth, bool try_ring) {
+	this->depth = depth < 1 ? 1 : depth;
+	in_flight = 0;
+	unsubmitted = 0;
+	ring_fd = -1;
+	sq_ring = cq_ring = sqes = NULL;
+	stopping = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_ready, NULL);
+	pthread_cond_init(&work_done, NULL);
+	if (try_ring && setupRing()) return;
+	for (int i = 0; i < IO_THREADS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, this) == 0) workers.push_back(thread);
+	}
+}
+
+io_engine::~io_engine() {
+	while (reap() != NULL);
+	closeRing();
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&work_ready);
+	pthread_mutex_unlock(&lock);
+	for (unsigned int i = 0; i < workers.size(); i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_cond_destroy(&work_done);
+	pthread_cond_destroy(&work_ready);
+	pthread_mutex_destroy(&lock);
+}
+
+/* Sets up an io_uring with room for depth requests and maps its queues.
+ * Returns true if the ring is ready to use.
+ */
+bool io_engine::setupRing() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (fd < 0) return false;
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) {
+		if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+		cq_ring_size = sq_ring_size;
+	}
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	cq_ring = sq_ring;
+	if (!single) {
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED) {
+			munmap(sq_ring, sq_ring_size);
+			close(fd);
+			return false;
+		}
+	}
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+		munmap(sq_ring, sq_ring_size);
+		close(fd);
+		return false;
+	}
+	char* sq = (char*)sq_ring;
+	sq_head = (unsigned int*)(sq + params.sq_off.head);
+	sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+	sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned int*)(sq + params.sq_off.array);
+	char* cq = (char*)cq_ring;
+	cq_head = (unsigned int*)(cq + params.cq_off.head);
+	cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+	cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+	cqes = cq + params.cq_off.cqes;
+	// never keep more in flight than the completion queue can hold
+	if ((unsigned int)depth > params.sq_entries) depth = params.sq_entries;
+	ring_fd = fd;
+	return true;
+}
+
+/* Unmaps the ring's queues and closes it, if there is one.
+ */
+void io_engine::closeRing() {
+	if (ring_fd < 0) return;
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+/* Moves pending requests onto the submission queue until the ring is full,
+ * then hands them all to the kernel with one system call.
+ * Returns false if the kernel refused them with an error.
+ */
+bool io_engine::startRequests() {
+	unsigned int tail = *sq_tail;
+	unsigned int queued = 0;
+	while (!pending.empty() && in_flight < depth) {
+		io_request* request = pending.front();
+		pending.pop_front();
+		unsigned int slot = tail & *sq_mask;
+		struct io_uring_sqe* sqe = (struct io_uring_sqe*)sqes + slot;
+		memset(sqe, 0, sizeof(*sqe));
+		request->iov.iov_base = request->buffer;
+		request->iov.iov_len = request->length;
+		sqe->opcode = request->op == IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+		sqe->fd = request->fd;
+		sqe->off = request->offset;
+		sqe->addr = (unsigned long)&request->iov;
+		sqe->len = 1;
+		sqe->user_data = (unsigned long)request;
+		sq_array[slot] = slot;
+		tail++;
+		queued++;
+		in_flight++;
+	}
+	if (queued > 0) __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+	unsubmitted += queued;
+	while (unsubmitted > 0) {
+		int n = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 0, 0, NULL, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) return false;
+		// anything the kernel didn't take is handed over again by waitRing
+		if (n == 0) break;
+		unsubmitted -= n;
+	}
+	return true;
+}
+
+/* Waits until at least one request completes and marks every completed
+ * request as done.
+ * Returns false if the wait failed with an error, so nothing will complete.
+ */
+bool io_engine::waitRing() {
+	unsigned int head = *cq_head;
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		int n = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno != EINTR) return false;
+		if (n > 0) unsubmitted -= n;
+	}
+	reapCompletions();
+	return true;
+}
+
+/* Marks every request the completion queue holds as done, without waiting.
+ */
+void io_engine::reapCompletions() {
+	unsigned int head = *cq_head;
+	unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe* cqe = (struct io_uring_cqe*)cqes + (head & *cq_mask);
+		io_request* request = (io_request*)cqe->user_data;
+		request->result = cqe->res;
+		// a short transfer or an interrupted one is finished by hand
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN) finishRequest(request, 0);
+		else if (cqe->res > 0 && (size_t)cqe->res < request->length)
+			finishRequest(request, cqe->res);
+		request->done = true;
+		in_flight--;
+		head++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Gives up on a ring the kernel won't take requests from or report on any
+ * more. Requests the kernel has already taken off the submission queue may
+ * still be running and write into their buffers, so their completions are
+ * waited for before the ring is closed. The rest never started; they are
+ * done with plain pread/pwrite, and so is every request from then on.
+ */
+void io_engine::abandonRing() {
+	while (true) {
+		reapCompletions();
+		unsigned int queued = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if ((unsigned int)in_flight <= queued) break;
+		usleep(1000);
+	}
+	closeRing();
+	for (unsigned int i = 0; i < order.size(); i++) {
+		if (order[i]->done) continue;
+		finishRequest(order[i], 0);
+		order[i]->done = true;
+	}
+	pending.clear();
+	in_flight = 0;
+	unsubmitted = 0;
+}
+
+/* Loop run by each pool thread: takes the next pending request and performs
+ * it synchronously.
+ */
+void* io_engine::worker(void* arg) {
+	io_engine* engine = (io_engine*)arg;
+	pthread_mutex_lock(&engine->lock);
+	while (true) {
+		while (!engine->stopping && engine->pending.empty()) {
+			pthread_cond_wait(&engine->work_ready, &engine->lock);
+		}
+		if (engine->pending.empty()) break;
+		io_request* request = engine->pending.front();
+		engine->pending.pop_front();
+		pthread_mutex_unlock(&engine->lock);
+		finishRequest(request, 0);
+		pthread_mutex_lock(&engine->lock);
+		request->done = true;
+		pthread_cond_broadcast(&engine->work_done);
+	}
+	pthread_mutex_unlock(&engine->lock);
+	return NULL;
+}
+
+void io_engine::submit(io_request* request) {
+	request->done = false;
+	request->result = 0;
+	if (ring_fd >= 0) {
+		order.push_back(request);
+		pending.push_back(request);
+		if (!startRequests()) abandonRing();
+		return;
+	}
+	if (workers.empty()) {
+		// no threads could be started, or the ring was given up; do the
+		// work right here
+		order.push_back(request);
+		finishRequest(request, 0);
+		request->done = true;
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	order.push_back(request);
+	pending.push_back(request);
+	pthread_cond_signal(&work_ready);
+	pthread_mutex_unlock(&lock);
+}
+
+void io_engine::submit(vector<io_request> &batch) {
+	for (unsigned int i = 0; i < batch.size(); i++) {
+		submit(&batch[i]);
+	}
+}
+
+io_request* io_engine::reap() {
+	if (order.empty()) return NULL;
+	io_request* request = order.front();
+	if (ring_fd >= 0) {
+		while (!request->done) {
+			if (!startRequests() || !waitRing()) abandonRing();
+		}
+	} else if (!workers.empty()) {
+		pthread_mutex_lock(&lock);
+		while (!request->done) {
+			pthread_cond_wait(&work_done, &lock);
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	order.pop_front();
+	return request;
+}
+
+void io_engine::run(vector<io_request> &batch) {
+	submit(batch);
+	while (reap() != NULL);
+}
+
+bool io_engine::usingRing() {
+	return ring_fd >= 0;
+}
+
+int io_engine::getDepth() {
+	return depth;
+}
@@ -0,0 +1,99 @@
+/*	File: ioengine.h
+	Author: Liam Morris
+	Description: Blueprints an asynchronous I/O engine that keeps a batch of
+		     cluster reads and writes in flight at once. It uses io_uring
+		     when the kernel allows it and a pool of threads otherwise.
+*/
+#ifndef IOENGINE_H
+#define IOENGINE_H
+#include <deque>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+const int IO_READ = 0;
+const int IO_WRITE = 1;
+
+// One read or write. The engine fills in result (bytes transferred, or
+// -errno) and sets done; the request must stay alive until it is reaped.
+typedef struct {
+	int op;
+	int fd;
+	char* buffer;
+	size_t length;
+	off_t offset;
+	ssize_t result;
+	bool done;
+	struct iovec iov;
+} io_request;
+
+class io_engine {
+public:
+	// constructor
+	// depth - the most requests that are in flight at once
+	// try_ring - use io_uring if the kernel supports it
+	io_engine(int depth, bool try_ring = true);
+
+	// destructor - tears down the ring or stops the worker threads
+	~io_engine();
+
+	// queues a request, or a whole batch of them; each is started as soon as
+	// there is room in the queue
+	void submit(io_request* request);
+	void submit(std::vector<io_request> &batch);
+
+	// waits for the oldest request that has not been reaped yet and returns
+	// it, so completions come back in the order they were submitted;
+	// NULL if nothing is outstanding
+	io_request* reap();
+
+	// submits a batch and waits for it, along with anything already queued
+	void run(std::vector<io_request> &batch);
+
+	bool usingRing();
+	int getDepth();
+
+private:
+	// io_uring backend; startRequests and waitRing return false once the
+	// ring stops working, and abandonRing then waits for what the kernel
+	// took and finishes the rest by hand
+	bool setupRing();
+	bool startRequests();
+	bool waitRing();
+	void reapCompletions();
+	void abandonRing();
+	void closeRing();
+
+	// thread pool backend
+	static void* worker(void* arg);
+
+	int depth;
+	int in_flight;
+	// requests on the submission queue the kernel hasn't taken yet
+	unsigned int unsubmitted;
+	// requests in submission order that have not been reaped
+	std::deque<io_request*> order;
+	// requests that have not been started yet
+	std::deque<io_request*> pending;
+
+	// ring state
+	int ring_fd;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	void* sqes;
+	size_t sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	void* cqes;
+
+	// pool state
+	std::vector<pthread_t> workers;
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	bool stopping;
+};
+#endif
@@ -0,0 +1,192 @@
+/*	File: journal.cpp
+	Author: Liam Morris
+	Description: Implements the metadata journal. A group of updates is logged
+		     as one or more transactions, made durable with one fdatasync,
+		     and only then copied to the FAT and directory table.
+*/
+#include "journal.h"
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+const unsigned int JOURNAL_MAGIC = 0x4C4E524A;
+const unsigned int TRANSACTION_MAGIC = 0x314E5854;
+
+// Transactions start after this many bytes of the region
+const size_t JOURNAL_HEADER_SIZE = 64;
+
+// Longest run of bytes kept in a single record
+const size_t MAX_RECORD = 4096;
+
+/* Rounds a record's data up so the next record stays aligned.
+ * size_t length - the length of the data
+ */
+static size_t padded(size_t length) {
+	return (length + 7) & ~(size_t)7;
+}
+
+journal::journal(char* image, size_t image_size, int fd, off_t start, size_t length) {
+	this->image = image;
+	this->image_size = image_size;
+	this->fd = fd;
+	this->start = start;
+	this->length = length;
+	write_pos = JOURNAL_HEADER_SIZE;
+	sequence = 1;
+	commits = 0;
+	syncs = 0;
+}
+
+void journal::format() {
+	journal_header header = { JOURNAL_MAGIC, sequence };
+	memcpy(image + start, &header, sizeof(header));
+	// Make sure nothing left in the region looks like a transaction
+	memset(image + start + JOURNAL_HEADER_SIZE, 0, sizeof(transaction_header));
+	write_pos = JOURNAL_HEADER_SIZE;
+}
+
+int journal::replay() {
+	journal_header header;
+	memcpy(&header, image + start, sizeof(header));
+	if (header.magic != JOURNAL_MAGIC) {
+		format();
+		return 0;
+	}
+	int count = 0;
+	size_t pos = JOURNAL_HEADER_SIZE;
+	sequence = header.sequence;
+	// Stop at the first transaction that is stale or was torn by a crash
+	while (pos + sizeof(transaction_header) <= length) {
+		transaction_header transaction;
+		memcpy(&transaction, image + start + pos, sizeof(transaction));
+		if (transaction.magic != TRANSACTION_MAGIC || transaction.sequence != sequence) break;
+		if (transaction.length > length - pos - sizeof(transaction)) break;
+		const char* records = image + start + pos + sizeof(transaction);
+		if (checksum(transaction.sequence, records, transaction.length) != transaction.checksum) break;
+		apply(records, transaction.length);
+		pos += sizeof(transaction) + transaction.length;
+		sequence++;
+		count++;
+	}
+	checkpoint();
+	return count;
+}
+
+void journal::add(off_t offset, const char* data, size_t length) {
+	while (length > 0) {
+		journal_record record;
+		record.offset = offset;
+		record.length = length < MAX_RECORD ? length : MAX_RECORD;
+		record.reserved = 0;
+		size_t at = group.size();
+		group.resize(at + sizeof(record) + padded(record.length), 0);
+		memcpy(&group[at], &record, sizeof(record));
+		memcpy(&group[at + sizeof(record)], data, record.length);
+		offset += record.length;
+		data += record.length;
+		length -= record.length;
+	}
+}
+
+bool journal::empty() {
+	return group.empty();
+}
+
+void journal::commit() {
+	if (group.empty()) return;
+	size_t first = 0;
+	size_t applied = 0;
+	while (first < group.size()) {
+		// Take as many whole records as fit in what is left of the region
+		size_t room = 0;
+		if (write_pos + sizeof(transaction_header) < length) {
+			room = length - write_pos - sizeof(transaction_header);
+		}
+		size_t last = first;
+		while (last < group.size()) {
+			journal_record record;
+			memcpy(&record, &group[last], sizeof(record));
+			size_t size = sizeof(record) + padded(record.length);
+			if (last + size - first > room) break;
+			last += size;
+		}
+		if (last == first) {
+			// The region is full. What has been logged is made durable and
+			// written home so the journal can start over; a group this big
+			// is only atomic in the pieces that fit.
+			sync();
+			apply(&group[applied], first - applied);
+			applied = first;
+			checkpoint();
+			continue;
+		}
+		writeTransaction(first, last);
+		first = last;
+	}
+	sync();
+	apply(&group[applied], group.size() - applied);
+	group.clear();
+	commits++;
+}
+
+void journal::checkpoint() {
+	sync();
+	journal_header header = { JOURNAL_MAGIC, sequence };
+	memcpy(image + start, &header, sizeof(header));
+	write_pos = JOURNAL_HEADER_SIZE;
+}
+
+int journal::getCommits() {
+	return commits;
+}
+
+int journal::getSyncs() {
+	return syncs;
+}
+
+/* Computes an FNV-1a hash over a transaction's sequence number and records.
+ * unsigned int sequence - the transaction's sequence number
+ * const char* records - the transaction's records
+ * size_t length - the length of the records in bytes
+ */
+unsigned int journal::checksum(unsigned int sequence, const char* records, size_t length) {
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < 4; i++) {
+		hash = (hash ^ ((sequence >> (i * 8)) & 0xFF)) * 16777619u;
+	}
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char)records[i]) * 16777619u;
+	}
+	return hash;
+}
+
+void journal::writeTransaction(size_t first, size_t last) {
+	transaction_header transaction;
+	transaction.magic = TRANSACTION_MAGIC;
+	transaction.sequence = sequence;
+	transaction.length = last - first;
+	transaction.checksum = checksum(sequence, &group[first], last - first);
+	char* at = image + start + write_pos;
+	memcpy(at, &transaction, sizeof(transaction));
+	memcpy(at + sizeof(transaction), &group[first], last - first);
+	write_pos += sizeof(transaction) + (last - first);
+	sequence++;
+}
+
+void journal::apply(const char* records, size_t length) {
+	size_t pos = 0;
+	while (pos + sizeof(journal_record) <= length) {
+		journal_record record;
+		memcpy(&record, records + pos, sizeof(record));
+		if (record.offset + record.length <= image_size) {
+			memcpy(image + record.offset, records + pos + sizeof(record), record.length);
+		}
+		pos += sizeof(record) + padded(record.length);
+	}
+}
+
+void journal::sync() {
+	fdatasync(fd);
+	syncs++;
+}
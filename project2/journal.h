@@ -0,0 +1,87 @@
+/*	File: journal.h
+	Author: Liam Morris
+	Description: Blueprints a write-ahead journal for metadata updates. Changes
+		     to the FAT and directory entries are logged to a region of the
+		     image and made durable together before they are written to
+		     their home locations.
+*/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <vector>
+#include <sys/types.h>
+
+// The journal region starts with a header naming the sequence number of the
+// first transaction that is still valid. Transactions follow it back to back;
+// each one is a header and a list of records, and every record is a run of
+// bytes and the image offset they belong at.
+typedef struct {
+	unsigned int magic;
+	unsigned int sequence;
+} journal_header;
+
+typedef struct {
+	unsigned int magic;
+	unsigned int sequence;
+	unsigned int length;
+	unsigned int checksum;
+} transaction_header;
+
+typedef struct {
+	unsigned long long offset;
+	unsigned int length;
+	unsigned int reserved;
+} journal_record;
+
+class journal {
+public:
+	// constructor
+	// image - the mapped image
+	// image_size - the size of the mapping
+	// fd - the image's file descriptor, used to make commits durable
+	// start - offset of the journal region in the image
+	// length - size of the journal region in bytes
+	journal(char* image, size_t image_size, int fd, off_t start, size_t length);
+
+	// writes an empty journal
+	void format();
+
+	// applies every transaction that was committed but may not have reached
+	// its home location, then empties the journal; returns how many there were
+	int replay();
+
+	// adds a run of bytes to the group that is being built
+	void add(off_t offset, const char* data, size_t length);
+	bool empty();
+
+	// logs the group with a single fdatasync, then writes it to its home
+	// locations
+	void commit();
+
+	// makes every home location durable so the journal can start over
+	void checkpoint();
+
+	int getCommits();
+	int getSyncs();
+
+private:
+	unsigned int checksum(unsigned int sequence, const char* records, size_t length);
+	// writes one transaction made from group[first, last) at write_pos
+	void writeTransaction(size_t first, size_t last);
+	// applies the records in group[first, last) to the image
+	void apply(const char* records, size_t length);
+	void sync();
+
+	char* image;
+	size_t image_size;
+	int fd;
+	off_t start;
+	size_t length;
+	// offset in the region where the next transaction goes
+	size_t write_pos;
+	unsigned int sequence;
+	// serialized records of the group being built
+	std::vector<char> group;
+	int commits;
+	int syncs;
+};
+#endif
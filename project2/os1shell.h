@@ -4,14 +4,6 @@
 */
 #ifndef OS1SHELL_H
 #define OS1SHELL_H
-#include <vector>
-typedef struct {
-	char name[112];
-	unsigned int index;
-	unsigned int size;
-	unsigned int type;
-	unsigned int creation;
-} directory_entry;
 
 // Main workhorse of the shell
 // Accepts a command from stdin, decides how to process it, then executes it
@@ -26,28 +18,6 @@ void clearBuffer(char** &theBuffer);
 // &buff - the buffer that the command gets stored in
 void getCommand(char* &buff);
 
+// Sends a command that works on the file system to the mounted volume
 void handleCommand(char** cmd);
-void printDT();
-void printFAT();
-
-int fileIndex(char* const &fileName);
-int fileEntry(char* const &fileName);
-
-std::vector<char> readCluster(int clusterIndex);
-int numAvailableClusters();
-std::vector<char> readFile(int clusterIndex, int size);
-void writeFile(char* file_name, std::vector<char> data);
-void removeFile(char* const &file_name);
-
-void readCluster(int clusterIndex, char* &data);
-void writeCluster(int clusterIndex, char* &data, unsigned int size);
-
-int findAvailableEntry();
-int writeFATRecord(int writeIndex);
-int findAvailableCluster();
-
-void updateDT();
-void updateFAT();
-void writeFAT();
-void listContents();
 #endif
@@ -0,0 +1,3628 @@
+/*	File: volume.cpp
+	Author: Liam Morris
+	Description: Implements the mounted file system image described in
+		     volume.h: the FAT and directory tables, the journal and
+		     everything that reads and writes files in the image.
+*/
+
+#include "volume.h"
+#include <iostream>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <errno.h>
+#include <string.h>
+#include <cstdlib>
+#include <iomanip>
+
+using namespace std;
+
+// Number of FAT entries covered by one dirty flag
+const int FAT_CHUNK = 1024;
+
+// Default number of clusters kept in the cluster cache, and how many clusters
+// further along a chain are read ahead when a cluster isn't cached
+const int DEFAULT_CACHE_CLUSTERS = 1024;
+const int DEFAULT_READ_AHEAD = 8;
+
+// Number of requests the I/O engine keeps in flight, and the most clusters
+// moved by a single request
+const int IO_DEPTH = 32;
+const int MAX_IO_CLUSTERS = 32;
+// Reads that reach further into a file than this many clusters look the file
+// up in its extent map instead of following its chain, and at most
+// MAX_EXTENT_MAPS maps are kept at once
+const unsigned int EXTENT_MIN_CLUSTERS = 16;
+const unsigned int MAX_EXTENT_MAPS = 1024;
+// Most files the random-access API can have open at once
+const int MAX_OPEN_FILES = 256;
+
+// Most threads a bulk import starts
+const int MAX_IMPORT_THREADS = 16;
+
+// Most shards the cluster allocator is split into
+const int ALLOC_SHARDS = 16;
+
+// Size of the metadata journal made by format: 1/64 of the clusters, kept
+// between JOURNAL_MIN_CLUSTERS clusters and JOURNAL_MAX_BYTES
+const int JOURNAL_MIN_CLUSTERS = 8;
+const int JOURNAL_MAX_BYTES = 4 * 1024 * 1024;
+
+// Commands are grouped into one journal commit until the oldest change in
+// the group is GROUP_COMMIT_MS old or GROUP_COMMIT_COMMANDS commands have
+// changed something
+const int GROUP_COMMIT_MS = 50;
+const int GROUP_COMMIT_COMMANDS = 32;
+
+// Most threads fsck splits the FAT between, and the walk numbers it uses:
+// the boot record and system chains get the small ones, files the rest
+const int MAX_FSCK_THREADS = 16;
+const unsigned int BOOT_WALK = 1;
+const unsigned int FAT_WALK = 2;
+const unsigned int ROOT_WALK = 3;
+const unsigned int JOURNAL_WALK = 4;
+const unsigned int FIRST_DIRECTORY_WALK = 5;
+
+// Directory entry types
+const unsigned int FILE_TYPE = 0;
+const unsigned int DIRECTORY_TYPE = 1;
+// Type of the in-memory slots that hold a compact table's header or the end
+// of a long name, which are neither free nor entries
+const unsigned int RESERVED_SLOT = 0xFFFFFFFF;
+
+// Directory table formats, kept in the boot record for new tables
+const unsigned int CLASSIC_FORMAT = 0;
+const unsigned int COMPACT_FORMAT = 2;
+// The first slot of a classic table is either a name or a cleared free
+// entry, so it can never start with this
+const char COMPACT_MAGIC[16] = "\0COMPACT-DIR-V2";
+
+volume::volume() {
+	fs_fd = -1;
+	fs_image = NULL;
+	FileAllocationTable = NULL;
+	boot_dirty = false;
+	cache = NULL;
+	read_ahead = DEFAULT_READ_AHEAD;
+	io = NULL;
+	fs_journal = NULL;
+	group_pending = false;
+	committer_stopping = false;
+	// Commits take the tree for writing, so writers are let in ahead of
+	// readers that come after them
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&tree_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	for (int i = 0; i < DIR_LOCKS; i++) pthread_rwlock_init(&dir_locks[i], NULL);
+	for (int i = 0; i < FILE_LOCKS; i++) pthread_rwlock_init(&file_locks[i], NULL);
+	pthread_mutex_init(&meta_lock, NULL);
+	pthread_mutex_init(&io_lock, NULL);
+	pthread_mutex_init(&commit_lock, NULL);
+}
+
+volume::~volume() {
+	unmount();
+	pthread_rwlock_destroy(&tree_lock);
+	for (int i = 0; i < DIR_LOCKS; i++) pthread_rwlock_destroy(&dir_locks[i]);
+	for (int i = 0; i < FILE_LOCKS; i++) pthread_rwlock_destroy(&file_locks[i]);
+	pthread_mutex_destroy(&meta_lock);
+	pthread_mutex_destroy(&io_lock);
+	pthread_mutex_destroy(&commit_lock);
+}
+
+/* Mounts an existing image: reads its boot record, finishes any metadata
+ * updates that were logged before it was last closed and loads the FAT and
+ * directory tables. Returns false if the image does not exist or cannot be
+ * mapped.
+ * const char* image - path of the image on the host
+ * const string &mount_point - the path that names the root of the image
+ */
+bool volume::mountImage(const char* image, const string &mount_point) {
+	image_path = image;
+	mount = mount_point;
+	if (!openImage()) return false;
+	// Read in boot record values
+	memcpy(bootrecord, fs_image, sizeof(bootrecord));
+	cluster_size = bootrecord[0];
+	root_index = bootrecord[2];
+	FAT_index = bootrecord[3];
+	if (bootrecord[4] == 0) {
+		// Older images keep one cluster of FAT entries, so clusters
+		// past that can't be used
+		FAT_clusters = 1;
+		num_clusters = bootrecord[1] / cluster_size;
+		if (num_clusters > cluster_size / sizeof(unsigned int)) {
+			num_clusters = cluster_size / sizeof(unsigned int);
+		}
+	} else {
+		FAT_clusters = bootrecord[4];
+		num_clusters = bootrecord[5];
+	}
+	fs_size = (off_t)num_clusters * cluster_size;
+	journal_index = bootrecord[6];
+	journal_clusters = bootrecord[7];
+	// Finish any metadata updates that were logged before the
+	// image was last closed
+	if (journal_index != 0) {
+		fs_journal = new journal(fs_image, fs_image_size, fs_fd, (off_t)journal_index * cluster_size,
+					 (size_t)journal_clusters * cluster_size);
+		int replayed = fs_journal->replay();
+		if (replayed > 0) cout << "Replayed " << replayed << " journal transactions." << endl;
+	}
+
+	// Initialize directory table and FAT
+	initTables();
+	updateFAT();
+	updateDT();
+	buildIndex();
+	buildFreeMap();
+	buildRefCounts();
+	cwd_index = root_index;
+	if (fs_journal != NULL) startCommitter();
+	cache = new cluster_cache(DEFAULT_CACHE_CLUSTERS, releaseCluster, this);
+	io = new io_engine(IO_DEPTH);
+	return true;
+}
+
+/* Makes a new image with an empty root directory and a journal, and mounts
+ * it. Returns false if the image cannot be created.
+ * const char* image - path of the image on the host
+ * const string &mount_point - the path that names the root of the image
+ * off_t size - size of the file system in bytes
+ * unsigned int cluster_size - size of a cluster in bytes
+ */
+bool volume::formatImage(const char* image, const string &mount_point, off_t size, unsigned int cluster_size) {
+	image_path = image;
+	mount = mount_point;
+	memset(bootrecord, 0, sizeof(bootrecord));
+	fs_size = size;
+	bootrecord[1] = (fs_size > 0xFFFFFFFFLL) ? 0 : fs_size;
+	this->cluster_size = cluster_size;
+	num_clusters = fs_size / cluster_size;
+	// The FAT takes as many clusters as it needs, and the root
+	// directory table follows it
+	FAT_clusters = (num_clusters * sizeof(unsigned int) + cluster_size - 1) / cluster_size;
+
+	// Initialize boot record, write file system to file
+	bootrecord[0] = cluster_size;
+	bootrecord[3] = 1;
+	FAT_index = 1;
+	bootrecord[2] = FAT_index + FAT_clusters;
+	root_index = FAT_index + FAT_clusters;
+	bootrecord[4] = FAT_clusters;
+	bootrecord[5] = num_clusters;
+	// The journal follows the root directory table
+	journal_clusters = num_clusters / 64;
+	if (journal_clusters > JOURNAL_MAX_BYTES / cluster_size) journal_clusters = JOURNAL_MAX_BYTES / cluster_size;
+	if (journal_clusters < JOURNAL_MIN_CLUSTERS) journal_clusters = JOURNAL_MIN_CLUSTERS;
+	journal_index = root_index + 1;
+	bootrecord[6] = journal_index;
+	bootrecord[7] = journal_clusters;
+	// Size the image without writing it. Only the boot record, FAT
+	// and root directory table are written, the rest stays sparse.
+	int fd = open(image, O_RDWR | O_CREAT, 0644);
+	if (fd == -1 || ftruncate(fd, fs_size) == -1) {
+		if (fd != -1) close(fd);
+		return false;
+	}
+	close(fd);
+	if (!openImage()) return false;
+	// New images get compact directory tables
+	bootrecord[9] = COMPACT_FORMAT;
+	memcpy(fs_image, bootrecord, sizeof(bootrecord));
+	// Initialize directory table and FAT. The FAT's own clusters
+	// are chained together like a file.
+	initTables();
+	newTable(root_index);
+	dir_owner[root_index] = root_index;
+	directories[root_index].parent = root_index;
+	cwd_index = root_index;
+	setFAT(0, 0xFFFF);
+	for (unsigned int i = FAT_index; i < FAT_index + FAT_clusters - 1; i++) {
+		setFAT(i, i + 1);
+	}
+	setFAT(FAT_index + FAT_clusters - 1, 0xFFFF);
+	setFAT(root_index, 0xFFFF);
+	for (unsigned int i = journal_index; i < journal_index + journal_clusters - 1; i++) {
+		setFAT(i, i + 1);
+	}
+	setFAT(journal_index + journal_clusters - 1, 0xFFFF);
+	ref_count[FAT_index] = 1;
+	ref_count[root_index] = 1;
+	ref_count[journal_index] = 1;
+	writeFAT();
+	encodeTable(root_index, clusterAddress(root_index));
+	dirty_entries.clear();
+	fs_journal = new journal(fs_image, fs_image_size, fs_fd, (off_t)journal_index * cluster_size,
+				 (size_t)journal_clusters * cluster_size);
+	fs_journal->format();
+	startCommitter();
+	cache = new cluster_cache(DEFAULT_CACHE_CLUSTERS, releaseCluster, this);
+	io = new io_engine(IO_DEPTH);
+	return true;
+}
+
+/* Commits whatever is left, closes the image and lets go of everything that
+ * was kept in memory for it.
+ */
+void volume::unmount() {
+	if (fs_image == NULL) return;
+	stopCommitter();
+	delete io;
+	io = NULL;
+	closeImage();
+	delete cache;
+	cache = NULL;
+	delete fs_journal;
+	fs_journal = NULL;
+	committer_stopping = false;
+	dropExtentMaps();
+	open_files.clear();
+	for (unordered_map<unsigned int, directory_index>::iterator it = directories.begin(); it != directories.end(); it++) {
+		delete it->second.tree;
+	}
+	for (unordered_map<unsigned int, directory_entry*>::iterator it = dir_table.begin(); it != dir_table.end(); it++) {
+		free(it->second);
+	}
+	directories.clear();
+	dir_owner.clear();
+	dir_table.clear();
+	dirty_entries.clear();
+	dirty_trees.clear();
+	compact_tables.clear();
+	free(FileAllocationTable);
+	free(FAT_dirty);
+	free(FAT_present);
+	free(ref_count);
+	delete free_map;
+	FileAllocationTable = NULL;
+}
+
+/* Starts a call. Calls that only touch one directory at a time share the
+ * tree, and the others have it to themselves.
+ * bool exclusive - lock the tree for writing
+ */
+void volume::lockTree(bool exclusive) {
+	if (exclusive) pthread_rwlock_wrlock(&tree_lock);
+	else pthread_rwlock_rdlock(&tree_lock);
+}
+
+/* Ends a call and writes back whatever it changed.
+ * bool flush - false for calls that only read
+ */
+void volume::unlockTree(bool flush) {
+	pthread_rwlock_unlock(&tree_lock);
+	if (flush) flushTables();
+}
+
+/* Locks a directory's table and index, which have to stay put while any
+ * of its names are looked up.
+ * unsigned int dir - first cluster of the directory's table
+ * bool write - lock it for changing rather than for reading
+ */
+void volume::lockDirectory(unsigned int dir, bool write) {
+	if (write) pthread_rwlock_wrlock(&dir_locks[dir % DIR_LOCKS]);
+	else pthread_rwlock_rdlock(&dir_locks[dir % DIR_LOCKS]);
+}
+
+void volume::unlockDirectory(unsigned int dir) {
+	pthread_rwlock_unlock(&dir_locks[dir % DIR_LOCKS]);
+}
+
+/* Locks a file's data. Entries only move while the tree is held exclusively,
+ * so the entry's index names the file for as long as the tree is shared.
+ * off_t entry_index - absolute index of the file's directory entry
+ * bool write - lock it for writing rather than for reading
+ */
+void volume::lockFile(off_t entry_index, bool write) {
+	pthread_rwlock_t* lock = &file_locks[(entry_index / sizeof(compact_entry)) % FILE_LOCKS];
+	if (write) pthread_rwlock_wrlock(lock);
+	else pthread_rwlock_rdlock(lock);
+}
+
+void volume::unlockFile(off_t entry_index) {
+	pthread_rwlock_unlock(&file_locks[(entry_index / sizeof(compact_entry)) % FILE_LOCKS]);
+}
+
+/* Starts a call that adds or replaces the entry for a path: locks the tree
+ * and the directory the entry goes in for writing, along with the file that
+ * already has the path if there is one. The tree is only locked exclusively
+ * when the directory's table is full and has to grow. Returns false, with
+ * nothing locked, if a directory on the way doesn't exist.
+ * const char* path - the path of the entry
+ * unsigned int &dir - set to the first cluster of the directory's table
+ * string &name - set to the last name in the path
+ * off_t &existing - set to the entry that has the path, or -1
+ */
+bool volume::lockParent(const char* path, unsigned int &dir, string &name, off_t &existing) {
+	bool exclusive = false;
+	while (true) {
+		lockTree(exclusive);
+		if (!resolvePath(path, dir, name)) {
+			pthread_rwlock_unlock(&tree_lock);
+			return false;
+		}
+		lockDirectory(dir, true);
+		existing = name.empty() ? -1 : findEntry(dir, name);
+		if (exclusive || existing != -1 || name.empty() || findAvailableEntry(dir, name.c_str(), false) != -1) break;
+		unlockDirectory(dir);
+		pthread_rwlock_unlock(&tree_lock);
+		exclusive = true;
+	}
+	if (existing != -1) lockFile(existing, true);
+	return true;
+}
+
+/* Ends a call started with lockParent.
+ * unsigned int dir - the directory that was locked
+ * off_t existing - the file that was locked, or -1
+ */
+void volume::unlockParent(unsigned int dir, off_t existing) {
+	if (existing != -1) unlockFile(existing);
+	unlockDirectory(dir);
+	unlockTree();
+}
+
+/* Locks a file by its path, holding its directory only while the name is
+ * looked up. The tree has to be held. Returns the file's entry, or -1 with
+ * nothing locked if there is no such file.
+ * const char* path - the path of the file
+ * bool write - lock it for writing rather than for reading
+ */
+off_t volume::lockEntry(const char* path, bool write) {
+	unsigned int dir;
+	string name;
+	if (!resolvePath(path, dir, name) || name.empty()) return -1;
+	lockDirectory(dir, false);
+	off_t entry_index = findEntry(dir, name);
+	if (entry_index != -1) lockFile(entry_index, write);
+	unlockDirectory(dir);
+	return entry_index;
+}
+
+unsigned int volume::getClusterSize() {
+	return cluster_size;
+}
+
+int volume::getClusters() {
+	return num_clusters;
+}
+
+// Returns an int representing the number of clusters free to write to in the system
+int volume::numAvailableClusters() {
+	return free_map->getFree();
+}
+
+/* Lists a directory, the current one if path is NULL.
+ * const char* path - the path of the directory
+ */
+void volume::listDirectory(const char* path) {
+	lockTree(false);
+	int dir = (path == NULL) ? cwd_index : findDirectory(path);
+	if (dir != -1) {
+		lockDirectory(dir, false);
+		listContents(dir);
+		unlockDirectory(dir);
+	}
+	else cerr << "Directory does not exist." << endl;
+	unlockTree(false);
+}
+
+/* Gets what a file or directory looks like to stat. Files are owned by
+ * whoever has the image mounted, and their times are all when they were
+ * made. Returns 0, or -1 with errno set.
+ * const char* path - the path of the file or directory
+ * struct stat* st - filled in with its size, type and times
+ */
+int volume::fs_stat(const char* path, struct stat* st) {
+	lockTree(false);
+	unsigned int dir;
+	string name;
+	int error = 0;
+	if (!resolvePath(path, dir, name)) error = ENOENT;
+	else if (name.empty()) {
+		// A path that ends in a directory itself, which may be the root and
+		// have no entry to go by
+		memset(st, 0, sizeof(struct stat));
+		st->st_ino = 1;
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		st->st_uid = getuid();
+		st->st_gid = getgid();
+		st->st_blksize = cluster_size;
+		if (dir != root_index) {
+			lockDirectory(directories[dir].parent, false);
+			vector<off_t> entries;
+			directoryEntries(directories[dir].parent, entries);
+			for (unsigned int i = 0; i < entries.size(); i++) {
+				directory_entry* entry = entryAddress(entries[i]);
+				if (entry->type == DIRECTORY_TYPE && entry->index == dir) statEntry(entries[i], st);
+			}
+			unlockDirectory(directories[dir].parent);
+		}
+	}
+	else {
+		lockDirectory(dir, false);
+		off_t entry_index = findEntry(dir, name);
+		if (entry_index == -1) error = ENOENT;
+		else statEntry(entry_index, st);
+		unlockDirectory(dir);
+	}
+	unlockTree(false);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Lists a directory's entries the way readdir does. Directories don't keep
+ * "." or "..", so they aren't in the list. Returns 0, or -1 with errno set.
+ * const char* path - the path of the directory
+ * vector<struct dirent> &entries - the entries, with their inode number,
+ *                                  type and name filled in
+ */
+int volume::fs_readdir(const char* path, vector<struct dirent> &entries) {
+	lockTree(false);
+	int dir = findDirectory(path);
+	if (dir != -1) {
+		lockDirectory(dir, false);
+		vector<off_t> found;
+		directoryEntries(dir, found);
+		for (unsigned int i = 0; i < found.size(); i++) {
+			directory_entry* entry = entryAddress(found[i]);
+			struct dirent de;
+			memset(&de, 0, sizeof(struct dirent));
+			de.d_ino = found[i] / sizeof(compact_entry) + 2;
+			de.d_type = (entry->type == DIRECTORY_TYPE) ? DT_DIR : DT_REG;
+			strcpy(de.d_name, entry->name);
+			entries.push_back(de);
+		}
+		unlockDirectory(dir);
+	}
+	unlockTree(false);
+	if (dir == -1) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	return 0;
+}
+
+/* Fills in a stat from a directory entry. Every entry has its own inode
+ * number, worked out from where the entry is; the root's is 1.
+ * off_t entry_index - absolute index of the entry
+ * struct stat* st - the stat being filled in
+ */
+void volume::statEntry(off_t entry_index, struct stat* st) {
+	directory_entry* entry = entryAddress(entry_index);
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = entry_index / sizeof(compact_entry) + 2;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_blksize = cluster_size;
+	st->st_atime = st->st_mtime = st->st_ctime = entry->creation;
+	if (entry->type == DIRECTORY_TYPE) {
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return;
+	}
+	st->st_mode = S_IFREG | 0644;
+	st->st_nlink = 1;
+	st->st_size = entry->size;
+	// Every file has at least one cluster
+	off_t clusters = ((off_t)entry->size + cluster_size - 1) / cluster_size;
+	if (clusters == 0) clusters = 1;
+	st->st_blocks = clusters * cluster_size / 512;
+}
+
+// Returns true if the current directory is the root of the image
+bool volume::atRoot() {
+	return cwd_index == root_index;
+}
+
+/* Creates an empty file, replacing the file if it exists. Its first cluster
+ * may still be shared with a copy, so a fresh one is always allocated.
+ * const char* path - the path of the file
+ */
+void volume::createFile(const char* path) {
+	unsigned int dir;
+	string name;
+	off_t entry_index;
+	if (!lockParent(path, dir, name, entry_index)) {
+		cerr << "Directory does not exist." << endl;
+		return;
+	}
+	off_t existing = entry_index;
+	pthread_mutex_lock(&meta_lock);
+	int write_index = findAvailableCluster();
+	if (write_index == -1) {
+		pthread_mutex_unlock(&meta_lock);
+		unlockParent(dir, existing);
+		cerr << "Not enough free space in system." << endl;
+		return;
+	}
+
+	// Update FAT and directory table accordingly
+	setFAT(write_index, 0xFFFF);
+	directory_entry* entry = new directory_entry;
+	entry->size = 0;
+	entry->type = FILE_TYPE;
+	entry->creation = time(0);
+	entry->index = write_index;
+	const char* error = placeEntry(dir, name, entry, entry_index);
+	if (error != NULL) {
+		setFAT(write_index, 0x0000);
+		cerr << error << endl;
+	}
+	delete entry;
+	pthread_mutex_unlock(&meta_lock);
+	unlockParent(dir, existing);
+}
+
+/* Prints part of a file to stdout. Freed clusters are not zeroed, so only
+ * the bytes up to the file's size are printed.
+ * const char* path - the path of the file
+ * unsigned int offset - the first byte printed
+ * unsigned int length - the most bytes printed
+ */
+void volume::catFile(const char* path, unsigned int offset, unsigned int length) {
+	lockTree(false);
+	off_t entry_index = lockEntry(path, false);
+	// Make sure it exists
+	if (entry_index != -1 && entryAddress(entry_index)->type == DIRECTORY_TYPE) {
+		cerr << "Cannot print a directory." << endl;
+	}
+	else if (entry_index != -1) {
+		directory_entry* entry = entryAddress(entry_index);
+		if (offset > entry->size) offset = entry->size;
+		if (length > entry->size - offset) length = entry->size - offset;
+		// The clusters are found with meta_lock held and printed without it,
+		// with only the file locked
+		vector<cluster_extent> extents;
+		pthread_mutex_lock(&meta_lock);
+		rangeExtents(entry->index, offset, length, extents);
+		pthread_mutex_unlock(&meta_lock);
+		printFile(extents, offset % cluster_size, length);
+		cout << endl;
+	}
+	else cerr << "File does not exist." << endl;
+	if (entry_index != -1) unlockFile(entry_index);
+	unlockTree(false);
+}
+
+/* Copies a file inside the file system. The copy shares the source's
+ * clusters, so only a new directory entry is written; a file that already
+ * has the new name is replaced.
+ * const char* path - the path of the file
+ * const char* new_path - the path of the copy, or a directory to put it in
+ */
+void volume::copyFile(const char* path, const char* new_path) {
+	lockTree(true);
+	off_t entry_index = fileEntry((char*)path);
+	if (entry_index == -1) {
+		unlockTree(false);
+		cerr << "Source file '" << path << "' does not exist." << endl;
+		return;
+	}
+	directory_entry entry;
+	memcpy(&entry, entryAddress(entry_index), sizeof(directory_entry));
+	if (entry.type != FILE_TYPE) {
+		unlockTree(false);
+		cerr << "Cannot copy directory." << endl;
+		return;
+	}
+	string destination = destinationPath(new_path, entry.name);
+	unsigned int dir;
+	string name;
+	if (!resolvePath(destination, dir, name)) {
+		unlockTree(false);
+		cerr << "Directory does not exist." << endl;
+		return;
+	}
+	if (!name.empty() && findEntry(dir, name) == entry_index) {
+		unlockTree(false);
+		return;
+	}
+	directory_entry* new_entry = new directory_entry;
+	new_entry->size = entry.size;
+	new_entry->creation = time(0);
+	new_entry->index = entry.index;
+	new_entry->type = entry.type;
+	// Replaces the file if it exists
+	off_t new_index;
+	const char* error = placeEntry(dir, name, new_entry, new_index);
+	if (error != NULL) cerr << error << endl;
+	delete new_entry;
+	unlockTree();
+}
+
+/* Copies a file out of the file system into a host file, replacing the host
+ * file if it exists. Each contiguous run of the file is copied with one call.
+ * const char* path - the path of the file
+ * const char* host_path - the file to write
+ * bool move - remove the file from the file system once it is copied
+ */
+void volume::exportFile(const char* path, const char* host_path, bool move) {
+	// A file that is moved out is removed from its directory afterwards, so
+	// the directory is held for the whole copy
+	unsigned int dir;
+	string name;
+	off_t entry_index = -1;
+	if (move && lockParent(path, dir, name, entry_index) && entry_index == -1) unlockParent(dir, -1);
+	if (!move) {
+		lockTree(false);
+		entry_index = lockEntry(path, false);
+		if (entry_index == -1) unlockTree(false);
+	}
+	if (entry_index == -1) {
+		cerr << "Source file '" << path << "' does not exist." << endl;
+		return;
+	}
+	directory_entry entry;
+	memcpy(&entry, entryAddress(entry_index), sizeof(directory_entry));
+	int write_file = -1;
+	if (entry.type != FILE_TYPE) cerr << "Cannot copy directory." << endl;
+	else if ((write_file = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		cerr << "Cannot open destination file." << endl;
+	}
+	if (write_file == -1) {
+		if (move) unlockParent(dir, entry_index);
+		else {
+			unlockFile(entry_index);
+			unlockTree(false);
+		}
+		return;
+	}
+	vector<io_request> batch;
+	vector<cluster_extent> extents;
+	pthread_mutex_lock(&meta_lock);
+	chainExtents(entry.index, 0, entry.size, extents);
+	pthread_mutex_unlock(&meta_lock);
+	unsigned int leftToWrite = entry.size;
+	off_t write_offset = 0;
+	for (unsigned int i = 0; i < extents.size(); i++) {
+		unsigned int write_size = extents[i].length * cluster_size;
+		if (leftToWrite < write_size) write_size = leftToWrite;
+		exportExtent(extents[i], write_file, write_offset, write_size, batch);
+		write_offset += write_size;
+		leftToWrite -= write_size;
+	}
+	pthread_mutex_lock(&io_lock);
+	io->run(batch);
+	pthread_mutex_unlock(&io_lock);
+	close(write_file);
+	if (move) {
+		pthread_mutex_lock(&meta_lock);
+		removeEntry(entry_index);
+		pthread_mutex_unlock(&meta_lock);
+		unlockParent(dir, entry_index);
+	} else {
+		unlockFile(entry_index);
+		unlockTree(false);
+	}
+}
+
+/* Changes how many clusters the cache holds. Returns false for a negative
+ * capacity, which is left alone.
+ * int capacity - the most clusters cached at once
+ */
+bool volume::setCacheCapacity(int capacity) {
+	if (capacity < 0) return false;
+	pthread_mutex_lock(&meta_lock);
+	cache->setCapacity(capacity);
+	pthread_mutex_unlock(&meta_lock);
+	return true;
+}
+
+/* Changes how far along a chain clusters are read ahead. Returns false for
+ * a negative number, which is left alone.
+ * int clusters - how many clusters past a miss are read ahead
+ */
+bool volume::setReadAhead(int clusters) {
+	if (clusters < 0) return false;
+	pthread_mutex_lock(&meta_lock);
+	read_ahead = clusters;
+	pthread_mutex_unlock(&meta_lock);
+	return true;
+}
+
+/* Prints the state of the cluster cache and the I/O engine.
+ */
+void volume::printCache() {
+	pthread_mutex_lock(&meta_lock);
+	cout << "Cache: " << cache->getCount() << "/" << cache->getCapacity() << " clusters, read-ahead "
+	     << read_ahead << ", " << cache->getHits() << " hits, " << cache->getMisses() << " misses" << endl;
+	cout << "I/O: " << (io->usingRing() ? "io_uring" : "thread pool") << ", depth " << io->getDepth() << endl;
+	pthread_mutex_unlock(&meta_lock);
+}
+
+/* Commits the current group and writes everything back to the image and to
+ * disk.
+ */
+void volume::syncImage() {
+	lockTree(true);
+	commitGroup();
+	msync(fs_image, fs_image_size, MS_SYNC);
+	unlockTree(false);
+}
+
+/* Copies a host file into the file system, replacing any file with the same
+ * name. The clusters are claimed first and linked, along with the directory
+ * entry, with only the directory locked; the data is copied afterwards with
+ * only the new file locked, so several threads can import at once.
+ * Returns NULL on success, or a message saying why the copy failed.
+ * const char* host_path - the file to copy
+ * const char* file_name - the path of the copy in the file system
+ */
+const char* volume::importFile(const char* host_path, const char* file_name) {
+	int read_file = open(host_path, O_RDONLY);
+	if (read_file == -1) return "Source file does not exist.";
+	struct stat st;
+	fstat(read_file, &st);
+	const char* error = NULL;
+	if (!S_ISREG(st.st_mode)) error = "Cannot copy directory.";
+	else if (st.st_size > 0xFFFFFFFFLL) error = "File is too large.";
+	if (error != NULL) {
+		close(read_file);
+		return error;
+	}
+	unsigned int leftToWrite = st.st_size;
+	// Claim the whole file up front, in one run if possible
+	int num_needed = (leftToWrite + cluster_size - 1) / cluster_size;
+	if (num_needed == 0) num_needed = 1;
+	vector<cluster_extent> extents;
+	if (!free_map->allocate(num_needed, -1, extents)) {
+		close(read_file);
+		return "Not enough free space in system.";
+	}
+	unsigned int dir;
+	string name;
+	off_t entry_index = -1;
+	bool found = lockParent(file_name, dir, name, entry_index);
+	if (!found) lockTree(false);
+	off_t existing = entry_index;
+	directory_entry* new_entry = new directory_entry;
+	new_entry->size = leftToWrite;
+	new_entry->creation = time(0);
+	new_entry->type = FILE_TYPE;
+	pthread_mutex_lock(&meta_lock);
+	new_entry->index = linkExtents(extents);
+	// Replaces the file if it exists; if the entry can't be written the
+	// clusters are given back
+	error = found ? placeEntry(dir, name, new_entry, entry_index) : "Directory does not exist.";
+	if (error != NULL) {
+		for (unsigned int cur_index = new_entry->index; cur_index != 0xFFFF; ) {
+			unsigned int next_index = FileAllocationTable[cur_index];
+			setFAT(cur_index, 0x0000);
+			cur_index = next_index;
+		}
+	}
+	delete new_entry;
+	pthread_mutex_unlock(&meta_lock);
+	if (error != NULL) {
+		if (found) unlockParent(dir, existing);
+		else unlockTree();
+		close(read_file);
+		return error;
+	}
+	// Nothing can read the new file until its data is all there
+	if (existing == -1) lockFile(entry_index, true);
+	unlockDirectory(dir);
+	off_t read_offset = 0;
+	vector<io_request> batch;
+	// The whole chain goes to the I/O engine as one batch
+	for (unsigned int i = 0; i < extents.size() && leftToWrite > 0; i++) {
+		unsigned int write_size = extents[i].length * cluster_size;
+		if (leftToWrite < write_size) write_size = leftToWrite;
+		importExtent(read_file, read_offset, extents[i], write_size, batch);
+		read_offset += write_size;
+		leftToWrite -= write_size;
+	}
+	if (!batch.empty()) {
+		pthread_mutex_lock(&io_lock);
+		io->run(batch);
+		pthread_mutex_unlock(&io_lock);
+	}
+	close(read_file);
+	unlockFile(entry_index);
+	unlockTree();
+	return NULL;
+}
+
+/* Copies many host files into a directory of the file system using a pool
+ * of threads, one per core. Each file keeps its host name without the
+ * directory part.
+ * char** sources - the files to copy; patterns such as dir/ followed by
+ *                  a * are expanded
+ * int num_sources - the number of sources
+ * const char* destination - the directory the files are copied into
+ */
+void volume::importFiles(char** sources, int num_sources, const char* destination) {
+	lockTree(false);
+	int dir = findDirectory(destination);
+	unlockTree(false);
+	if (dir == -1) {
+		cerr << "Directory does not exist." << endl;
+		return;
+	}
+	import_job job;
+	job.fs = this;
+	job.next = 0;
+	job.destination = destination;
+	// Expand the patterns; a later file with the same name replaces an
+	// earlier one, so two threads never write the same entry
+	unordered_map<string, int> position;
+	for (int i = 0; i < num_sources; i++) {
+		glob_t matches;
+		if (glob(sources[i], GLOB_NOCHECK, NULL, &matches) != 0) continue;
+		for (size_t j = 0; j < matches.gl_pathc; j++) {
+			string path = matches.gl_pathv[j];
+			string name = path.substr(path.rfind('/') + 1);
+			if (position.find(name) != position.end()) {
+				job.sources[position[name]] = path;
+				continue;
+			}
+			position[name] = job.sources.size();
+			job.sources.push_back(path);
+			job.names.push_back(name);
+		}
+		globfree(&matches);
+	}
+	job.errors.resize(job.sources.size(), NULL);
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads > MAX_IMPORT_THREADS) num_threads = MAX_IMPORT_THREADS;
+	if (num_threads > (int)job.sources.size()) num_threads = job.sources.size();
+	if (num_threads < 1) num_threads = 1;
+	vector<pthread_t> threads;
+	for (int i = 0; i < num_threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, importWorker, &job) == 0) threads.push_back(thread);
+	}
+	// If no thread could be started the copies are done here instead
+	if (threads.empty()) importWorker(&job);
+	for (unsigned int i = 0; i < threads.size(); i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (unsigned int i = 0; i < job.sources.size(); i++) {
+		if (job.errors[i] != NULL) cerr << job.sources[i] << ": " << job.errors[i] << endl;
+	}
+}
+
+/* Body of each bulk import thread: copies files until none are left.
+ * void* arg - the import_job being worked on
+ */
+void* volume::importWorker(void* arg) {
+	import_job* job = (import_job*)arg;
+	while (true) {
+		int i = __sync_fetch_and_add(&job->next, 1);
+		if (i >= (int)job->sources.size()) break;
+		string file_name = job->destination + "/" + job->names[i];
+		job->errors[i] = job->fs->importFile(job->sources[i].c_str(), file_name.c_str());
+	}
+	return NULL;
+}
+
+/* Rearranges the clusters in use so that each file is one run, in directory
+ * order, and all free space is at the end of the file system. Every cluster
+ * is given a place first; then, in passes, clusters are copied into their
+ * place once it is free, or parked past the end of the packed area while it
+ * isn't. A cluster is only ever copied into one that was free when the last
+ * pass was committed, and the cluster it leaves isn't handed out again until
+ * the next commit, so an interrupted defrag leaves every file readable.
+ * Chains shared by copies stay shared. The file system should pass fsck first.
+ */
+void volume::defragment() {
+	lockTree(true);
+	defrag_state state;
+	state.link = (unsigned int*)malloc(num_clusters * sizeof(unsigned int));
+	memset(state.link, 0xFF, num_clusters * sizeof(unsigned int));
+	for (unsigned int i = 0; i < num_clusters; i++) {
+		unsigned int next_index = FileAllocationTable[i];
+		if (next_index == 0x0000 || next_index == 0xFFFF || next_index >= num_clusters) continue;
+		if (state.link[next_index] == 0xFFFFFFFF) state.link[next_index] = i;
+		else state.more_links.insert(make_pair(next_index, i));
+	}
+	// The boot record, the system chains, the directory tables and the
+	// reserved clusters stay put
+	vector<char> pinned(num_clusters, 0);
+	pinned[0] = 1;
+	unsigned int system_chains[3] = { FAT_index, root_index, journal_index };
+	for (int i = 0; i < 3; i++) {
+		for (unsigned int cur_index = system_chains[i]; cur_index != 0 && cur_index < num_clusters && !pinned[cur_index];
+		     cur_index = FileAllocationTable[cur_index]) {
+			pinned[cur_index] = 1;
+		}
+	}
+	for (unordered_map<unsigned int, directory_entry*>::iterator it = dir_table.begin(); it != dir_table.end(); it++) {
+		pinned[it->first] = 1;
+	}
+	// Name B-tree nodes link to each other by cluster, so they stay put too
+	for (unordered_map<unsigned int, directory_index>::iterator dir = directories.begin(); dir != directories.end(); dir++) {
+		if (dir->second.tree == NULL) continue;
+		for (unsigned int cur_index = dir->second.tree->getRoot(); cur_index < num_clusters && !pinned[cur_index];
+		     cur_index = FileAllocationTable[cur_index]) {
+			pinned[cur_index] = 1;
+		}
+	}
+	for (unsigned int i = 0; i < num_clusters; i++) {
+		if (FileAllocationTable[i] == 0x0000 && free_map->isSet(i)) pinned[i] = 1;
+	}
+	// Give every cluster in use its place: files in directory order, each
+	// chain, and then anything in use that no file reaches. Directories are
+	// taken from the root down, a level at a time.
+	vector<unsigned int> chains;
+	vector<unsigned int> order(1, root_index);
+	for (unsigned int d = 0; d < order.size(); d++) {
+		for (unsigned int cur_index = order[d]; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+			directory_entry* table = dir_table[cur_index];
+			for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+				if (table[i].name[0] == 0x00) continue;
+				if (table[i].type == DIRECTORY_TYPE) {
+					if (directories.count(table[i].index) != 0 && directories[table[i].index].parent == order[d]) {
+						order.push_back(table[i].index);
+					}
+					continue;
+				}
+				off_t entry_index = slotOffset(cur_index, i);
+				state.entries.insert(make_pair(table[i].index, entry_index));
+				chains.push_back(table[i].index);
+			}
+		}
+	}
+	for (unsigned int i = 0; i < num_clusters; i++) {
+		if (FileAllocationTable[i] != 0x0000 && !pinned[i]) chains.push_back(i);
+	}
+	vector<char> placed(num_clusters, 0);
+	// destined[place] - the cluster that belongs at place
+	vector<unsigned int> destined(num_clusters, 0);
+	vector<unsigned int> places;
+	unsigned int cursor = 0;
+	for (unsigned int i = 0; i < chains.size(); i++) {
+		unsigned int cur_index = chains[i];
+		while (cur_index < num_clusters && FileAllocationTable[cur_index] != 0x0000
+		       && !placed[cur_index] && !pinned[cur_index]) {
+			placed[cur_index] = 1;
+			while (pinned[cursor]) cursor++;
+			destined[cursor] = cur_index;
+			places.push_back(cursor++);
+			cur_index = FileAllocationTable[cur_index];
+		}
+	}
+	unsigned int packed_end = cursor;
+	int moved = 0;
+	int passes = 0;
+	while (true) {
+		int moved_this_pass = 0;
+		for (unsigned int i = 0; i < places.size(); i++) {
+			unsigned int place = places[i];
+			unsigned int cur_index = destined[place];
+			if (cur_index == place) continue;
+			// Imports take clusters without the tree, so every cluster a copy
+			// goes to is claimed first; one taken in the meantime is skipped
+			if (free_map->claimCluster(place)) {
+				relocateCluster(state, cur_index, place);
+				destined[place] = place;
+				moved_this_pass++;
+			}
+			// Park it past the packed area so its place can be freed
+			else if (cur_index < packed_end) {
+				int parking = free_map->nextFree(packed_end);
+				if (parking < (int)packed_end || !free_map->claimCluster(parking)) continue;
+				relocateCluster(state, cur_index, parking);
+				destined[place] = parking;
+				moved_this_pass++;
+			}
+		}
+		if (moved_this_pass == 0) break;
+		moved += moved_this_pass;
+		passes++;
+		// The copies have to be on disk before the links to them are
+		fdatasync(fs_fd);
+		commitGroup();
+		for (unsigned int i = 0; i < state.quarantine.size(); i++) {
+			free_map->clear(state.quarantine[i]);
+		}
+		state.quarantine.clear();
+	}
+	free(state.link);
+	unlockTree();
+	cout << "Moved " << moved << " clusters in " << passes << " passes." << endl;
+}
+
+/* Copies a cluster to a free one and moves every link to it: the FAT entries
+ * and directory entries that refer to it, and its own link to the next
+ * cluster. The old cluster is freed in the FAT but kept out of the bitmap
+ * until the move is committed.
+ * defrag_state &state - the links to each cluster
+ * unsigned int from - the cluster being moved
+ * unsigned int to - the cluster it is moved to, already claimed in the
+ *                   bitmap so nothing else can take it
+ */
+void volume::relocateCluster(defrag_state &state, unsigned int from, unsigned int to) {
+	memcpy(clusterAddress(to), clusterAddress(from), cluster_size);
+	unsigned int next_index = FileAllocationTable[from];
+	setFAT(to, next_index);
+	// The next cluster is now linked from the copy
+	if (next_index != 0xFFFF && next_index < num_clusters) {
+		if (state.link[next_index] == from) state.link[next_index] = to;
+		else {
+			pair<unordered_multimap<unsigned int, unsigned int>::iterator,
+			     unordered_multimap<unsigned int, unsigned int>::iterator> links = state.more_links.equal_range(next_index);
+			for (unordered_multimap<unsigned int, unsigned int>::iterator it = links.first; it != links.second; it++) {
+				if (it->second == from) it->second = to;
+			}
+		}
+	}
+	// Point the links to the cluster at the copy
+	if (state.link[from] != 0xFFFFFFFF) {
+		setFAT(state.link[from], to);
+		state.link[to] = state.link[from];
+		state.link[from] = 0xFFFFFFFF;
+	}
+	pair<unordered_multimap<unsigned int, unsigned int>::iterator,
+	     unordered_multimap<unsigned int, unsigned int>::iterator> links = state.more_links.equal_range(from);
+	vector<unsigned int> more;
+	for (unordered_multimap<unsigned int, unsigned int>::iterator it = links.first; it != links.second; it++) {
+		setFAT(it->second, to);
+		more.push_back(it->second);
+	}
+	state.more_links.erase(from);
+	for (unsigned int i = 0; i < more.size(); i++) state.more_links.insert(make_pair(to, more[i]));
+	// And the directory entries that start with it
+	pair<unordered_multimap<unsigned int, off_t>::iterator,
+	     unordered_multimap<unsigned int, off_t>::iterator> starts = state.entries.equal_range(from);
+	vector<off_t> moved_entries;
+	for (unordered_multimap<unsigned int, off_t>::iterator it = starts.first; it != starts.second; it++) {
+		directory_entry* entry = entryAddress(it->second);
+		entry->index = to;
+		ref_count[from]--;
+		ref_count[to]++;
+		indexEntry(it->second);
+		dirty_entries.insert(it->second);
+		moved_entries.push_back(it->second);
+	}
+	state.entries.erase(from);
+	for (unsigned int i = 0; i < moved_entries.size(); i++) state.entries.insert(make_pair(to, moved_entries[i]));
+	setFAT(from, 0x0000);
+	free_map->set(from);
+	state.quarantine.push_back(from);
+}
+
+/* Prints how fragmented the files and the free space are.
+ * const char* label - printed at the start of the line
+ */
+void volume::printFragmentation(const char* label) {
+	lockTree(true);
+	int files = 0;
+	int fragmented = 0;
+	long runs = 0;
+	for (unordered_map<unsigned int, directory_entry*>::iterator it = dir_table.begin(); it != dir_table.end(); it++) {
+		for (unsigned int j = 0; j < tableSlots(it->first); j++) {
+			if (it->second[j].name[0] == 0x00 || it->second[j].type == DIRECTORY_TYPE) continue;
+			int file_runs = 1;
+			unsigned int cur_index = it->second[j].index;
+			// Bounded so a damaged chain can't loop forever
+			for (unsigned int i = 0; i < num_clusters && cur_index < num_clusters; i++) {
+				unsigned int next_index = FileAllocationTable[cur_index];
+				if (next_index == 0xFFFF || next_index == 0x0000) break;
+				if (next_index != cur_index + 1) file_runs++;
+				cur_index = next_index;
+			}
+			files++;
+			runs += file_runs;
+			if (file_runs > 1) fragmented++;
+		}
+	}
+	vector<cluster_extent> free_runs;
+	free_map->freeRuns(free_runs);
+	unsigned int largest = 0;
+	for (unsigned int i = 0; i < free_runs.size(); i++) {
+		if (free_runs[i].length > largest) largest = free_runs[i].length;
+	}
+	cout << label << ": " << files << " files, " << fragmented << " fragmented, " << runs << " runs";
+	if (files > 0) cout << " (" << setprecision(3) << (double)runs / files << " per file)";
+	cout << "; free space in " << free_runs.size() << " runs, largest " << largest << " clusters" << endl;
+	unlockTree(false);
+}
+
+/* Checks that the FAT and directory tables agree. Every chain is walked once,
+ * marking the clusters it reaches, which finds links that lead nowhere,
+ * chains that loop, files that run into the FAT, a directory table or the
+ * journal, entries whose chain is shorter than their size, and clusters in
+ * use that nothing reaches. The scans of the whole FAT are split between
+ * threads by range. Clusters reached by more than one file are shared by
+ * copies, which is allowed.
+ * bool repair - fix what was found: bad links and loops are cut, entries that
+ *               point nowhere are removed, sizes are shortened to fit their
+ *               chains, unreachable clusters are freed and name B-trees
+ *               that don't match their tables are rebuilt
+ */
+void volume::checkFileSystem(bool repair) {
+	lockTree(true);
+	fsck_report report;
+	report.files = 0;
+	report.shared = 0;
+	// Until the files are walked, every earlier walk is a system chain
+	report.first_file_walk = 0xFFFFFFFF;
+	// The number of the walk that reached each cluster first, 0 if none did
+	unsigned int* visited = (unsigned int*)calloc(num_clusters, sizeof(unsigned int));
+	scanRanges(findBadLinks, visited, report.bad_links);
+	unsigned int stop;
+	visited[0] = BOOT_WALK;
+	walkChain(FAT_index, FAT_WALK, visited, report, stop);
+	walkChain(root_index, ROOT_WALK, visited, report, stop);
+	if (journal_index != 0) walkChain(journal_index, JOURNAL_WALK, visited, report, stop);
+	unsigned int id = FIRST_DIRECTORY_WALK;
+	for (unordered_map<unsigned int, directory_index>::iterator dir = directories.begin(); dir != directories.end(); dir++) {
+		if (dir->first != root_index && visited[dir->first] == 0) walkChain(dir->first, id++, visited, report, stop);
+		if (dir->second.tree != NULL && visited[dir->second.tree->getRoot()] == 0) {
+			walkChain(dir->second.tree->getRoot(), id++, visited, report, stop);
+		}
+	}
+	report.first_file_walk = id;
+	for (unordered_map<unsigned int, directory_index>::iterator dir = directories.begin(); dir != directories.end(); dir++) {
+		// A name B-tree has to lead to every entry and to nothing else
+		btree* tree = dir->second.tree;
+		unsigned int used = 0;
+		bool stale = false;
+		for (unsigned int cur_index = dir->first; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+			directory_entry* table = dir_table[cur_index];
+			for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+				if (table[i].name[0] == 0x00) continue;
+				off_t entry_index = slotOffset(cur_index, i);
+				unsigned int start = table[i].index;
+				unsigned long long found;
+				used++;
+				if (tree != NULL && (!tree->find(table[i].name, found) || found != (unsigned long long)entry_index)) stale = true;
+				// A directory's entry has to lead to the table that was loaded
+				// for it, and only one entry can
+				if (table[i].type == DIRECTORY_TYPE) {
+					if (directories.count(start) == 0 || start == root_index || directories[start].parent != dir->first
+					    || visited[start] < FIRST_DIRECTORY_WALK) {
+						report.bad_entries.push_back(entry_index);
+					}
+					continue;
+				}
+				report.files++;
+				// The entry has to lead to a cluster in use that isn't part of
+				// the FAT, a directory table or the journal
+				if (start >= num_clusters || FileAllocationTable[start] == 0x0000
+				    || (visited[start] != 0 && visited[start] < report.first_file_walk)) {
+					report.bad_entries.push_back(entry_index);
+					continue;
+				}
+				unsigned int length = walkChain(start, id++, visited, report, stop);
+				// A chain that joins one walked before goes on as far as that one
+				unsigned int needed = (table[i].size + cluster_size - 1) / cluster_size;
+				while (length < needed && stop != 0xFFFF) {
+					length++;
+					unsigned int next_index = FileAllocationTable[stop];
+					if (next_index >= num_clusters || FileAllocationTable[next_index] == 0x0000) break;
+					stop = next_index;
+				}
+				if (length < needed) {
+					report.short_entries.push_back(entry_index);
+					report.short_lengths.push_back(length);
+				}
+			}
+		}
+		if (tree != NULL) {
+			vector<unsigned long long> values;
+			tree->list(values);
+			if (stale || values.size() != used) report.stale_trees.push_back(dir->first);
+		}
+	}
+	scanRanges(findOrphans, visited, report.orphans);
+	free(visited);
+
+	cout << "Checked " << num_clusters << " clusters and " << report.files << " files." << endl;
+	cout << setw(8) << report.bad_links.size() << " links to free or missing clusters" << endl;
+	cout << setw(8) << report.cycles.size() << " chains that loop" << endl;
+	cout << setw(8) << report.system_links.size() << " chains that run into the FAT, a directory table or the journal" << endl;
+	cout << setw(8) << report.bad_entries.size() << " entries that point at no file" << endl;
+	cout << setw(8) << report.short_entries.size() << " entries larger than their chains" << endl;
+	cout << setw(8) << report.stale_trees.size() << " directory indexes that don't match their tables" << endl;
+	cout << setw(8) << report.orphans.size() << " clusters in use that no file reaches" << endl;
+	cout << setw(8) << report.shared << " chains shared by copies" << endl;
+	int problems = report.bad_links.size() + report.cycles.size() + report.system_links.size()
+		       + report.bad_entries.size() + report.short_entries.size() + report.orphans.size()
+		       + report.stale_trees.size();
+	if (problems == 0) {
+		unlockTree(false);
+		cout << "File system is clean." << endl;
+		return;
+	}
+	if (!repair) {
+		unlockTree(false);
+		cout << "Run fsck -r to repair it." << endl;
+		return;
+	}
+	for (unsigned int i = 0; i < report.bad_links.size(); i++) setFAT(report.bad_links[i], 0xFFFF);
+	for (unsigned int i = 0; i < report.cycles.size(); i++) setFAT(report.cycles[i], 0xFFFF);
+	for (unsigned int i = 0; i < report.system_links.size(); i++) setFAT(report.system_links[i], 0xFFFF);
+	for (unsigned int i = 0; i < report.bad_entries.size(); i++) {
+		directory_entry* entry = entryAddress(report.bad_entries[i]);
+		// The entry's cluster can't be trusted, so it isn't passed to clearEntry
+		if (entry->index < num_clusters) ref_count[entry->index]--;
+		unindexEntry(report.bad_entries[i]);
+		releaseSlots(report.bad_entries[i]);
+		moveOpenFiles(report.bad_entries[i], -1);
+		memset(entry, 0, sizeof(directory_entry));
+		dirty_entries.insert(report.bad_entries[i]);
+	}
+	for (unsigned int i = 0; i < report.short_entries.size(); i++) {
+		directory_entry* entry = entryAddress(report.short_entries[i]);
+		entry->size = report.short_lengths[i] * cluster_size;
+		indexEntry(report.short_entries[i]);
+		dirty_entries.insert(report.short_entries[i]);
+	}
+	for (unsigned int i = 0; i < report.orphans.size(); i++) setFAT(report.orphans[i], 0x0000);
+	// Stale name B-trees are rebuilt from their tables in the root node,
+	// and the rest of their nodes are freed
+	for (unsigned int i = 0; i < report.stale_trees.size(); i++) {
+		btree* tree = directories[report.stale_trees[i]].tree;
+		unsigned int cur_index = FileAllocationTable[tree->getRoot()];
+		setFAT(tree->getRoot(), 0xFFFF);
+		while (cur_index != 0xFFFF && cur_index < num_clusters && ref_count[cur_index] == 0) {
+			unsigned int next_index = FileAllocationTable[cur_index];
+			setFAT(cur_index, 0x0000);
+			cur_index = next_index;
+		}
+		buildTree(report.stale_trees[i]);
+	}
+	unlockTree();
+	cout << "Repaired " << problems << " problems." << endl;
+}
+
+/* Walks a chain from its first cluster, marking each cluster with the walk's
+ * number, until it ends or reaches a cluster that was already marked. Loops
+ * and runs into system chains are added to the report. Returns the number of
+ * clusters that were marked.
+ * unsigned int start - the first cluster of the chain
+ * unsigned int id - the walk's number
+ * unsigned int* visited - the walk number of every cluster reached so far
+ * fsck_report &report - where problems are added
+ * unsigned int &stop - set to the cluster where the chain joined one walked
+ *                      before, or 0xFFFF
+ */
+unsigned int volume::walkChain(unsigned int start, unsigned int id, unsigned int* visited, fsck_report &report, unsigned int &stop) {
+	unsigned int length = 0;
+	unsigned int prev_index = 0xFFFF;
+	unsigned int cur_index = start;
+	stop = 0xFFFF;
+	while (visited[cur_index] == 0) {
+		visited[cur_index] = id;
+		length++;
+		unsigned int next_index = FileAllocationTable[cur_index];
+		// Links to free or missing clusters were found by the range scan
+		if (next_index == 0xFFFF || next_index >= num_clusters || FileAllocationTable[next_index] == 0x0000) {
+			return length;
+		}
+		prev_index = cur_index;
+		cur_index = next_index;
+	}
+	if (visited[cur_index] == id) report.cycles.push_back(prev_index);
+	else if (visited[cur_index] < report.first_file_walk) report.system_links.push_back(prev_index);
+	else {
+		report.shared++;
+		stop = cur_index;
+	}
+	return length;
+}
+
+/* Runs a scan over the whole FAT, split by range between up to one thread
+ * per core, and gathers the clusters each thread found in FAT order.
+ * void* (*scan)(void*) - the scan, given an fsck_range
+ * unsigned int* visited - passed on to the scan
+ * vector<unsigned int> &found - where the clusters found are added
+ */
+void volume::scanRanges(void* (*scan)(void*), unsigned int* visited, vector<unsigned int> &found) {
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads > MAX_FSCK_THREADS) num_threads = MAX_FSCK_THREADS;
+	if (num_threads < 1) num_threads = 1;
+	// Ranges are whole FAT chunks
+	unsigned int num_chunks = (num_clusters + FAT_CHUNK - 1) / FAT_CHUNK;
+	unsigned int per_thread = (num_chunks + num_threads - 1) / num_threads * FAT_CHUNK;
+	vector<fsck_range> ranges(num_threads);
+	vector<pthread_t> threads(num_threads);
+	vector<bool> started(num_threads);
+	for (int i = 0; i < num_threads; i++) {
+		ranges[i].first = i * per_thread;
+		ranges[i].last = ranges[i].first + per_thread;
+		if (ranges[i].first > num_clusters) ranges[i].first = num_clusters;
+		if (ranges[i].last > num_clusters) ranges[i].last = num_clusters;
+		ranges[i].visited = visited;
+		ranges[i].fs = this;
+		started[i] = (i > 0 && pthread_create(&threads[i], NULL, scan, &ranges[i]) == 0);
+	}
+	// The first range, and any whose thread didn't start, are done here
+	for (int i = 0; i < num_threads; i++) {
+		if (!started[i]) scan(&ranges[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		if (started[i]) pthread_join(threads[i], NULL);
+		found.insert(found.end(), ranges[i].found.begin(), ranges[i].found.end());
+	}
+}
+
+/* Finds the clusters in a range whose FAT entry links to a cluster that is
+ * free or past the end of the file system.
+ * void* arg - the fsck_range to scan
+ */
+void* volume::findBadLinks(void* arg) {
+	fsck_range* range = (fsck_range*)arg;
+	unsigned int* FAT = range->fs->FileAllocationTable;
+	for (unsigned int i = range->first; i < range->last; i++) {
+		unsigned int next_index = FAT[i];
+		if (next_index == 0x0000 || next_index == 0xFFFF) continue;
+		if (next_index >= range->fs->num_clusters || FAT[next_index] == 0x0000) range->found.push_back(i);
+	}
+	return NULL;
+}
+
+/* Finds the clusters in a range that are in use but weren't reached by any
+ * walk.
+ * void* arg - the fsck_range to scan
+ */
+void* volume::findOrphans(void* arg) {
+	fsck_range* range = (fsck_range*)arg;
+	for (unsigned int i = range->first; i < range->last; i++) {
+		if (range->fs->FileAllocationTable[i] != 0x0000 && range->visited[i] == 0) range->found.push_back(i);
+	}
+	return NULL;
+}
+
+/* Removes a file from the internal file system. Only the directory entry and
+ * the FAT are touched; the file's data is left in place unless secure is set.
+ * Clusters that are shared with a copy of the file are kept for the copy.
+ * const char* path - the path of the file to be removed
+ * bool secure - zero-fill every cluster that is freed
+ */
+void volume::removeFile(const char* path, bool secure) {
+	if (fs_unlink(path, secure) == 0) return;
+	if (errno == EISDIR) cerr << "Cannot remove a directory, use rmdir." << endl;
+	else cerr << "File does not exist." << endl;
+}
+
+/* The same as removeFile, with errors reported in errno like unlink.
+ * Returns 0, or -1 with errno set.
+ */
+int volume::fs_unlink(const char* path, bool secure) {
+	unsigned int dir;
+	string name;
+	off_t entry_index = -1;
+	int error = 0;
+	bool found = lockParent(path, dir, name, entry_index);
+	if (entry_index != -1 && entryAddress(entry_index)->type == DIRECTORY_TYPE) error = EISDIR;
+	else if (entry_index != -1) {
+		pthread_mutex_lock(&meta_lock);
+		removeEntry(entry_index, secure);
+		pthread_mutex_unlock(&meta_lock);
+	}
+	else error = ENOENT;
+	if (found) unlockParent(dir, entry_index);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Clears a directory entry and frees the clusters of its chain that nothing
+ * else refers to.
+ * off_t entry_index - absolute index of the entry in the file system
+ * bool secure - zero-fill every cluster that is freed
+ */
+void volume::removeEntry(off_t entry_index, bool secure) {
+	unsigned int read_index = entryAddress(entry_index)->index;
+	clearEntry(entry_index);
+	moveOpenFiles(entry_index, -1);
+	// Free clusters until one is reached that something else still refers to.
+	// Freeing a cluster drops its reference to the next one.
+	// Clusters that are zeroed stay claimed in the bitmap until they are, so
+	// an import can't take one and have its data zeroed.
+	vector<cluster_extent> freed;
+	while (read_index != 0xFFFF && ref_count[read_index] == 0) {
+		if (secure) {
+			if (!freed.empty() && freed.back().start + freed.back().length == read_index) {
+				freed.back().length++;
+			} else {
+				cluster_extent run = { read_index, 1 };
+				freed.push_back(run);
+			}
+		}
+		unsigned int next_index = FileAllocationTable[read_index];
+		setFAT(read_index, 0x0000);
+		if (secure) free_map->set(read_index);
+		read_index = next_index;
+	}
+	if (!secure) return;
+	zeroClusters(freed);
+	for (unsigned int i = 0; i < freed.size(); i++) {
+		for (unsigned int k = 0; k < freed[i].length; k++) free_map->clear(freed[i].start + k);
+	}
+}
+
+/* Makes a cluster of a file safe to write in place. If the chain up to that
+ * cluster is shared with another file, the shared part is copied so that this
+ * file gets clusters of its own; the chain after the cluster stays shared.
+ * Returns the cluster to write, or -1 if there is no room for the copy.
+ * off_t entry_index - absolute index of the file's directory entry
+ * int position - which cluster of the file is being written (0 is the first)
+ */
+int volume::unshareCluster(off_t entry_index, int position) {
+	directory_entry* entry = entryAddress(entry_index);
+	vector<unsigned int> path;
+	int first_shared = -1;
+	unsigned int cur_index = entry->index;
+	for (int i = 0; i <= position; i++) {
+		if (i > 0) cur_index = FileAllocationTable[cur_index];
+		path.push_back(cur_index);
+		if (first_shared == -1 && ref_count[cur_index] > 1) first_shared = i;
+	}
+	if (first_shared == -1) return cur_index;
+
+	// Copy the shared part of the chain into new clusters
+	vector<cluster_extent> extents;
+	int new_index = allocateExtents(position - first_shared + 1, extents);
+	if (new_index == -1) return -1;
+	int copy_index = new_index;
+	for (int i = first_shared; i <= position; i++) {
+		memcpy(clusterAddress(copy_index), clusterAddress(path[i]), cluster_size);
+		if (i < position) copy_index = FileAllocationTable[copy_index];
+	}
+	// The copy rejoins the shared chain after the cluster being written, and
+	// whatever pointed at the first shared cluster now points at the copy
+	setFAT(copy_index, FileAllocationTable[path[position]]);
+	if (first_shared == 0) {
+		directory_entry new_entry;
+		memcpy(&new_entry, entry, sizeof(directory_entry));
+		new_entry.index = new_index;
+		writeEntry(entry_index, &new_entry);
+	} else {
+		setFAT(path[first_shared - 1], new_index);
+	}
+	return copy_index;
+}
+
+/* Opens a file in the file system for reading and writing at any offset.
+ * Returns a descriptor for the other fs_ calls, or -1 with errno set.
+ * const char* path - the path of the file
+ * int flags - O_RDONLY, O_WRONLY or O_RDWR, along with O_CREAT to make the
+ *             file if it doesn't exist (and O_EXCL to fail if it does) and
+ *             O_TRUNC to empty it
+ */
+int volume::fs_open(const char* path, int flags) {
+	unsigned int dir;
+	string name;
+	off_t entry_index = -1;
+	int error = 0;
+	if (!lockParent(path, dir, name, entry_index)) {
+		errno = ENOENT;
+		return -1;
+	}
+	off_t existing = entry_index;
+	pthread_mutex_lock(&meta_lock);
+	int fd = 0;
+	while ((size_t)fd < open_files.size() && open_files[fd].in_use) fd++;
+	if (fd == MAX_OPEN_FILES) error = EMFILE;
+	else if (entry_index != -1 && entryAddress(entry_index)->type == DIRECTORY_TYPE) error = EISDIR;
+	else if (entry_index != -1 && (flags & O_CREAT) && (flags & O_EXCL)) error = EEXIST;
+	else if (entry_index == -1 && !(flags & O_CREAT)) error = ENOENT;
+	else if (entry_index == -1) {
+		// A new file is empty but still has a cluster, like an empty import
+		directory_entry entry;
+		memset(&entry, 0, sizeof(directory_entry));
+		entry.creation = time(0);
+		entry.type = FILE_TYPE;
+		int new_index = findAvailableCluster();
+		if (new_index == -1) error = ENOSPC;
+		else {
+			setFAT(new_index, 0xFFFF);
+			entry.index = new_index;
+			if (placeEntry(dir, name, &entry, entry_index) != NULL) {
+				setFAT(new_index, 0x0000);
+				error = ENOENT;
+			}
+		}
+	}
+	if (error == 0 && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY && !truncateEntry(entry_index, 0)) error = ENOSPC;
+	if (error == 0) {
+		if ((size_t)fd == open_files.size()) open_files.resize(fd + 1);
+		open_files[fd].in_use = true;
+		open_files[fd].entry_index = entry_index;
+		open_files[fd].flags = flags;
+	}
+	pthread_mutex_unlock(&meta_lock);
+	unlockParent(dir, existing);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
+
+/* Reads from an open file at an offset, without moving anything else.
+ * Returns the number of bytes read, which is less than count at the end of
+ * the file, or -1 with errno set.
+ * int fd - the descriptor from fs_open
+ * char* buffer - where the bytes are put
+ * size_t count - the most bytes to read
+ * off_t offset - where in the file to start
+ */
+ssize_t volume::fs_pread(int fd, char* buffer, size_t count, off_t offset) {
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	lockTree(false);
+	vector<cluster_extent> extents;
+	off_t entry_index = readExtents(fd, count, offset, extents);
+	if (entry_index == -1) {
+		unlockTree(false);
+		return -1;
+	}
+	copyExtents(extents, offset % cluster_size, count, buffer, false);
+	unlockFile(entry_index);
+	unlockTree(false);
+	return count;
+}
+
+/* Reads from an open file into a pipe, like fs_pread, but the bytes are
+ * spliced from the image's pages instead of being copied. Returns the
+ * number of bytes moved, or -1 with errno set; the pipe needs room for all
+ * of them, and may hold some of them after an error.
+ * int fd - the descriptor from fs_open
+ * int pipe_fd - the write end of the pipe
+ * size_t count - the most bytes to read
+ * off_t offset - where in the file to start
+ */
+ssize_t volume::fs_splice(int fd, int pipe_fd, size_t count, off_t offset) {
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	lockTree(false);
+	vector<cluster_extent> extents;
+	off_t entry_index = readExtents(fd, count, offset, extents);
+	if (entry_index == -1) {
+		unlockTree(false);
+		return -1;
+	}
+	int error = 0;
+	size_t skip = offset % cluster_size;
+	size_t left = count;
+	for (unsigned int i = 0; i < extents.size() && left > 0 && error == 0; i++) {
+		off_t image_offset = (off_t)extents[i].start * cluster_size + skip;
+		size_t length = (size_t)extents[i].length * cluster_size - skip;
+		if (left < length) length = left;
+		while (length > 0) {
+			ssize_t moved = splice(fs_fd, &image_offset, pipe_fd, NULL, length, SPLICE_F_MOVE);
+			if (moved <= 0) {
+				error = (moved == 0) ? EIO : errno;
+				break;
+			}
+			length -= moved;
+			left -= moved;
+		}
+		skip = 0;
+	}
+	unlockFile(entry_index);
+	unlockTree(false);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return count;
+}
+
+/* Locks an open file for reading and finds the runs of clusters that hold
+ * part of it. Returns the file's entry, with the file still locked, or -1
+ * with errno set and nothing locked. The tree has to be held.
+ * int fd - the descriptor from fs_open
+ * size_t &count - the most bytes to read, cut down to what is left of the file
+ * off_t offset - where in the file to start
+ * vector<cluster_extent> &extents - the runs, in file order
+ */
+off_t volume::readExtents(int fd, size_t &count, off_t offset, vector<cluster_extent> &extents) {
+	off_t entry_index = lockOpenFile(fd, O_RDONLY, false);
+	if (entry_index == -1) return -1;
+	directory_entry* entry = entryAddress(entry_index);
+	if (offset >= entry->size) count = 0;
+	else if (count > (size_t)(entry->size - offset)) count = entry->size - offset;
+	// The clusters are found with meta_lock held and read without it
+	rangeExtents(entry->index, offset, count, extents);
+	pthread_mutex_unlock(&meta_lock);
+	return entry_index;
+}
+
+/* Writes to an open file at an offset. Writing past the end makes the file
+ * longer, and any gap before offset reads back as zeros. Clusters shared
+ * with a copy of the file are copied first, so the copy doesn't change.
+ * Returns the number of bytes written, or -1 with errno set.
+ * int fd - the descriptor from fs_open
+ * const char* buffer - the bytes to write
+ * size_t count - the number of bytes to write
+ * off_t offset - where in the file to start
+ */
+ssize_t volume::fs_pwrite(int fd, const char* buffer, size_t count, off_t offset) {
+	if (offset < 0 || offset + (off_t)count > 0xFFFFFFFFLL) {
+		errno = offset < 0 ? EINVAL : EFBIG;
+		return -1;
+	}
+	lockTree(false);
+	off_t entry_index = lockOpenFile(fd, O_WRONLY, true);
+	if (entry_index == -1) {
+		unlockTree(false);
+		return -1;
+	}
+	unsigned int dir = dir_owner[entry_index / cluster_size];
+	int error = 0;
+	vector<cluster_extent> extents;
+	if (count > 0) {
+		unsigned int size = entryAddress(entry_index)->size;
+		// Only the gap before offset needs zeroing, the rest is written over
+		if (offset > size && !truncateEntry(entry_index, offset)) error = ENOSPC;
+		else if (offset + count > size && !truncateEntry(entry_index, offset + count, false)) error = ENOSPC;
+		else if (!ownClusters(entry_index, (offset + count - 1) / cluster_size)) error = ENOSPC;
+		else rangeExtents(entryAddress(entry_index)->index, offset, count, extents);
+	}
+	// The data is copied with only the file locked
+	pthread_mutex_unlock(&meta_lock);
+	unlockDirectory(dir);
+	if (error == 0) copyExtents(extents, offset % cluster_size, count, (char*)buffer, true);
+	unlockFile(entry_index);
+	unlockTree(count > 0);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return count;
+}
+
+/* Makes an open file a given length. A file that gets longer reads back
+ * as zeros past its old end, and clusters past the new end are freed.
+ * Returns 0, or -1 with errno set.
+ * int fd - the descriptor from fs_open
+ * off_t length - the new length of the file
+ */
+int volume::fs_truncate(int fd, off_t length) {
+	if (length < 0 || length > 0xFFFFFFFFLL) {
+		errno = length < 0 ? EINVAL : EFBIG;
+		return -1;
+	}
+	lockTree(false);
+	off_t entry_index = lockOpenFile(fd, O_WRONLY, true);
+	if (entry_index == -1) {
+		unlockTree(false);
+		return -1;
+	}
+	int error = 0;
+	if (!truncateEntry(entry_index, length)) error = ENOSPC;
+	pthread_mutex_unlock(&meta_lock);
+	unlockDirectory(dir_owner[entry_index / cluster_size]);
+	unlockFile(entry_index);
+	unlockTree();
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Closes a file opened with fs_open. Returns 0, or -1 with errno set.
+ * int fd - the descriptor from fs_open
+ */
+int volume::fs_close(int fd) {
+	pthread_mutex_lock(&meta_lock);
+	if (fd < 0 || (size_t)fd >= open_files.size() || !open_files[fd].in_use) {
+		pthread_mutex_unlock(&meta_lock);
+		errno = EBADF;
+		return -1;
+	}
+	open_files[fd].in_use = false;
+	pthread_mutex_unlock(&meta_lock);
+	return 0;
+}
+
+/* Locks an open file for a read or a write and takes meta_lock. A write also
+ * locks the file's directory for writing, since the file's size and chain
+ * are kept in its entry. Returns the file's entry, or -1 with errno set and
+ * nothing locked if the descriptor isn't open for the kind of access wanted
+ * or the file is gone. The tree has to be held.
+ * int fd - the descriptor from fs_open
+ * int access - O_RDONLY to read or O_WRONLY to write
+ * bool write - lock the file for writing
+ */
+off_t volume::lockOpenFile(int fd, int access, bool write) {
+	pthread_mutex_lock(&meta_lock);
+	directory_entry* entry = openEntry(fd, access);
+	off_t entry_index = (entry == NULL) ? -1 : open_files[fd].entry_index;
+	pthread_mutex_unlock(&meta_lock);
+	if (entry_index == -1) return -1;
+	// The file and directory locks come before meta_lock, so the descriptor
+	// is looked at again once they are held
+	unsigned int dir = dir_owner[entry_index / cluster_size];
+	if (write) lockDirectory(dir, true);
+	lockFile(entry_index, write);
+	pthread_mutex_lock(&meta_lock);
+	entry = openEntry(fd, access);
+	if (entry != NULL && open_files[fd].entry_index == entry_index) return entry_index;
+	// Removed, or closed and opened again as another file, in the meantime
+	if (entry != NULL) errno = EBADF;
+	pthread_mutex_unlock(&meta_lock);
+	unlockFile(entry_index);
+	if (write) unlockDirectory(dir);
+	return -1;
+}
+
+/* Returns the entry of an open file, or NULL with errno set if the
+ * descriptor isn't open for the kind of access wanted or the file is gone.
+ * int fd - the descriptor from fs_open
+ * int access - O_RDONLY to read or O_WRONLY to write
+ */
+directory_entry* volume::openEntry(int fd, int access) {
+	if (fd < 0 || (size_t)fd >= open_files.size() || !open_files[fd].in_use) {
+		errno = EBADF;
+		return NULL;
+	}
+	int mode = open_files[fd].flags & O_ACCMODE;
+	if ((access == O_RDONLY && mode == O_WRONLY) || (access == O_WRONLY && mode == O_RDONLY)) {
+		errno = EBADF;
+		return NULL;
+	}
+	// The file was removed or replaced after it was opened
+	if (open_files[fd].entry_index == -1) {
+		errno = ESTALE;
+		return NULL;
+	}
+	return entryAddress(open_files[fd].entry_index);
+}
+
+/* Points the open files that use one entry at another, after the entry has
+ * moved, or marks them as gone.
+ * off_t from - absolute index of the entry the files were opened through
+ * off_t to - where the entry is now, or -1 if the file was removed
+ */
+void volume::moveOpenFiles(off_t from, off_t to) {
+	for (unsigned int fd = 0; fd < open_files.size(); fd++) {
+		if (open_files[fd].in_use && open_files[fd].entry_index == from) open_files[fd].entry_index = to;
+	}
+}
+
+/* Copies bytes between a buffer and part of a file in the image, a run of
+ * clusters at a time. The part of the file has to be there already.
+ * unsigned int start - the first cluster of the file
+ * off_t offset - where in the file the bytes start
+ * size_t count - the number of bytes
+ * char* buffer - the bytes, or NULL to write zeros
+ * bool write - true to copy into the file, false to copy out of it
+ */
+void volume::copyRange(unsigned int start, off_t offset, size_t count, char* buffer, bool write) {
+	vector<cluster_extent> extents;
+	rangeExtents(start, offset, count, extents);
+	copyExtents(extents, offset % cluster_size, count, buffer, write);
+}
+
+/* Finds the runs of clusters that hold part of a file and records their use
+ * in the cache. The part of the file has to be there already.
+ * unsigned int start - the first cluster of the file
+ * off_t offset - where in the file the bytes start
+ * size_t count - the number of bytes
+ * vector<cluster_extent> &extents - the runs, in file order
+ */
+void volume::rangeExtents(unsigned int start, off_t offset, size_t count, vector<cluster_extent> &extents) {
+	if (count == 0) return;
+	chainExtents(start, offset, count, extents);
+	for (unsigned int i = 0; i < extents.size(); i++) {
+		for (unsigned int k = 0; k < extents[i].length; k++) cacheCluster(extents[i].start + k);
+	}
+}
+
+/* Copies bytes between a buffer and runs of clusters from rangeExtents.
+ * vector<cluster_extent> &extents - the runs
+ * size_t skip - where in the first cluster the bytes start
+ * size_t count - the number of bytes
+ * char* buffer - the bytes, or NULL to write zeros
+ * bool write - true to copy into the clusters, false to copy out of them
+ */
+void volume::copyExtents(vector<cluster_extent> &extents, size_t skip, size_t count, char* buffer, bool write) {
+	for (unsigned int i = 0; i < extents.size() && count > 0; i++) {
+		size_t length = (size_t)extents[i].length * cluster_size - skip;
+		if (count < length) length = count;
+		char* address = clusterAddress(extents[i].start) + skip;
+		if (!write) memcpy(buffer, address, length);
+		else if (buffer == NULL) memset(address, 0, length);
+		else memcpy(address, buffer, length);
+		if (buffer != NULL) buffer += length;
+		count -= length;
+		skip = 0;
+	}
+}
+
+/* Makes sure the clusters of a file up to a position are its own, copying
+ * any that are shared with another file. Returns false if there is no room
+ * for the copy.
+ * off_t entry_index - absolute index of the file's directory entry
+ * unsigned int position - the last cluster of the file that has to be its own
+ */
+bool volume::ownClusters(off_t entry_index, unsigned int position) {
+	int shared = fileExtents(entryAddress(entry_index)->index)->getShared();
+	if (shared == -1 || (unsigned int)shared > position) return true;
+	return unshareCluster(entry_index, position) != -1;
+}
+
+/* Changes the length of a file, adding clusters to the end of its chain or
+ * freeing the ones past its new end. Returns false if there is no room for
+ * the clusters it needs.
+ * off_t entry_index - absolute index of the file's directory entry
+ * unsigned int length - the new length of the file in bytes
+ * bool zero - zero-fill what the file grows into; callers that are about to
+ *             write over all of it don't need to
+ */
+bool volume::truncateEntry(off_t entry_index, unsigned int length, bool zero) {
+	directory_entry entry;
+	memcpy(&entry, entryAddress(entry_index), sizeof(directory_entry));
+	unsigned int needed = ((off_t)length + cluster_size - 1) / cluster_size;
+	// Every file keeps at least one cluster
+	if (needed == 0) needed = 1;
+	unsigned int have = fileExtents(entry.index)->getLength();
+	if (needed != have || length > entry.size) {
+		// The cluster the chain changes at, and the ones before it, can't
+		// be shared or the other file would change too
+		unsigned int last = (needed < have ? needed : have) - 1;
+		if (!ownClusters(entry_index, last)) return false;
+		memcpy(&entry, entryAddress(entry_index), sizeof(directory_entry));
+	}
+	if (needed > have) {
+		vector<cluster_extent> extents;
+		int new_index = allocateExtents(needed - have, extents);
+		if (new_index == -1) return false;
+		setFAT(fileExtents(entry.index)->lookup(have - 1), new_index);
+	}
+	else if (needed < have) {
+		// Free the clusters past the end that nothing else refers to
+		unsigned int cur_index = fileExtents(entry.index)->lookup(needed - 1);
+		unsigned int read_index = FileAllocationTable[cur_index];
+		setFAT(cur_index, 0xFFFF);
+		while (read_index != 0xFFFF && ref_count[read_index] == 0) {
+			unsigned int next_index = FileAllocationTable[read_index];
+			setFAT(read_index, 0x0000);
+			read_index = next_index;
+		}
+	}
+	// Freed clusters aren't zeroed, so whatever the file grows into is
+	if (zero && length > entry.size) copyRange(entry.index, entry.size, length - entry.size, NULL, true);
+	if (length != entry.size) {
+		entry.size = length;
+		writeEntry(entry_index, &entry);
+	}
+	return true;
+}
+
+/* Renames a file in the internal file system without touching its data,
+ * moving it to another directory if the new path is in one. A file that
+ * already has the new name is removed first; a directory is not.
+ * char* file_name - the current path of the file
+ * char* new_name - the path the file is given
+ */
+void volume::renameFile(char* const &file_name, char* const &new_name) {
+	lockTree(true);
+	off_t entry_index = fileEntry(file_name);
+	int error = ENOENT;
+	if (entry_index != -1) error = moveEntry(entry_index, destinationPath(new_name, entryAddress(entry_index)->name));
+	unlockTree();
+	if (error == ENOENT) cerr << "Source file '" << file_name << "' does not exist." << endl;
+	else if (error == ENOTDIR) cerr << "Directory does not exist." << endl;
+	else if (error == EINVAL) cerr << "Cannot move a directory into itself." << endl;
+	else if (error == EEXIST) cerr << "A file name is needed." << endl;
+	else if (error == ENAMETOOLONG) cerr << "File name is too long." << endl;
+	else if (error == EISDIR) cerr << "A directory with that name exists." << endl;
+	else if (error == ENOSPC) cerr << "Not enough free space in system." << endl;
+}
+
+/* Renames a file or directory to exactly the new path, like rename. A file
+ * that already has the new path is replaced; a directory is not. Returns 0,
+ * or -1 with errno set.
+ * const char* path - the current path
+ * const char* new_path - the path it is given
+ * bool replace - if false, nothing is replaced and EEXIST is returned when
+ *                the new path is taken; the check is made under the same
+ *                lock as the move, like RENAME_NOREPLACE
+ */
+int volume::fs_rename(const char* path, const char* new_path, bool replace) {
+	lockTree(true);
+	off_t entry_index = fileEntry((char*)path);
+	int error = (entry_index == -1) ? ENOENT : moveEntry(entry_index, new_path, replace);
+	unlockTree();
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/* Moves an entry to a new path. The tree has to be held exclusively.
+ * Returns 0, or the errno value saying why it couldn't be moved: ENOTDIR if
+ * the new path's directory doesn't exist, EEXIST if the path names a
+ * directory itself, EINVAL for a directory moved into itself, and
+ * ENAMETOOLONG, EISDIR or ENOSPC from placing the entry.
+ * off_t entry_index - absolute index of the entry being moved
+ * const string &target - the path it is given
+ * bool replace - a file already at the path is replaced; if false, EEXIST
+ *                is returned instead
+ */
+int volume::moveEntry(off_t entry_index, const string &target, bool replace) {
+	directory_entry entry;
+	memcpy(&entry, entryAddress(entry_index), sizeof(directory_entry));
+	unsigned int dir;
+	string name;
+	if (!resolvePath(target, dir, name)) return ENOTDIR;
+	off_t target_index = name.empty() ? -1 : findEntry(dir, name);
+	if (target_index != -1 && !replace) return EEXIST;
+	if (target_index == entry_index) return 0;
+	// A directory can't be moved into itself
+	if (entry.type == DIRECTORY_TYPE && insideDirectory(dir, entry.index)) return EINVAL;
+	if (name.empty()) return EEXIST;
+	if (name.length() >= sizeof(entry.name)) return ENAMETOOLONG;
+	if (target_index != -1 && entryAddress(target_index)->type == DIRECTORY_TYPE) return EISDIR;
+	off_t new_index;
+	if (placeEntry(dir, name, &entry, new_index) != NULL) return ENOSPC;
+	clearEntry(entry_index);
+	moveOpenFiles(entry_index, new_index);
+	if (entry.type == DIRECTORY_TYPE) directories[entry.index].parent = dir;
+	return 0;
+}
+
+/* Splits a path into the directory that holds it and its last name. Paths
+ * that start with the mount point are followed from the root and others
+ * from the current directory, one name at a time; "." and ".." work as
+ * usual. The name is empty when the path ends in a directory itself, such
+ * as the mount point or "docs/". Returns false if a directory on the way
+ * doesn't exist. Each directory on the way is locked for reading while a
+ * name is looked up in it, so no directory lock can be held by the caller.
+ * const string &path - the path being followed
+ * unsigned int &dir - set to the first cluster of the directory's table
+ * string &name - set to the last name in the path
+ */
+bool volume::resolvePath(const string &path, unsigned int &dir, string &name) {
+	string rest = path;
+	dir = cwd_index;
+	if (rest.compare(0, mount.length(), mount) == 0 && (rest.length() == mount.length() || rest[mount.length()] == '/')) {
+		dir = root_index;
+		rest = rest.substr(mount.length());
+	}
+	name = "";
+	while (true) {
+		size_t slash = rest.find('/');
+		string part = rest.substr(0, slash);
+		rest = (slash == string::npos) ? "" : rest.substr(slash + 1);
+		if (part == "..") dir = directories[dir].parent;
+		else if (part != "" && part != ".") {
+			if (slash == string::npos) {
+				name = part;
+				return true;
+			}
+			index_entry ie;
+			lockDirectory(dir, false);
+			bool found = lookupEntry(dir, part, ie);
+			unlockDirectory(dir);
+			if (!found || ie.type != DIRECTORY_TYPE || directories.count(ie.index) == 0) return false;
+			dir = ie.index;
+		}
+		if (slash == string::npos) return true;
+	}
+}
+
+/* Finds the index of a file in one directory's table, or -1 if it isn't there.
+ * unsigned int dir - first cluster of the directory's table
+ * const string &name - the name of the file
+ */
+off_t volume::findEntry(unsigned int dir, const string &name) {
+	index_entry ie;
+	if (!lookupEntry(dir, name, ie)) return -1;
+	return ie.offset;
+}
+
+/* Looks a name up in a directory's index: its name B-tree if it has one,
+ * or the hashed index built at mount time. Returns false if it isn't there.
+ * unsigned int dir - first cluster of the directory's table
+ * const string &name - the name of the file
+ * index_entry &ie - set to what the index keeps for the file
+ */
+bool volume::lookupEntry(unsigned int dir, const string &name, index_entry &ie) {
+	directory_index &index = directories[dir];
+	if (index.tree == NULL) {
+		unordered_map<string, index_entry>::iterator it = index.entries.find(name);
+		if (it == index.entries.end()) return false;
+		ie = it->second;
+		return true;
+	}
+	unsigned long long offset;
+	if (!index.tree->find(name.c_str(), offset)) return false;
+	// A tree that is out of date can't lead outside the directory
+	unordered_map<unsigned int, unsigned int>::iterator owner = dir_owner.find(offset / cluster_size);
+	if (owner == dir_owner.end() || owner->second != dir) return false;
+	directory_entry* entry = entryAddress(offset);
+	if (strcmp(entry->name, name.c_str()) != 0) return false;
+	ie.offset = offset;
+	ie.index = entry->index;
+	ie.size = entry->size;
+	ie.type = entry->type;
+	return true;
+}
+
+/* Finds the first cluster of a directory's table, or -1 if the path doesn't
+ * name a directory.
+ * const string &path - the path of the directory
+ */
+int volume::findDirectory(const string &path) {
+	unsigned int dir;
+	string name;
+	index_entry ie;
+	if (!resolvePath(path, dir, name)) return -1;
+	if (name.empty()) return dir;
+	lockDirectory(dir, false);
+	bool found = lookupEntry(dir, name, ie);
+	unlockDirectory(dir);
+	if (!found || ie.type != DIRECTORY_TYPE || directories.count(ie.index) == 0) return -1;
+	return ie.index;
+}
+
+/* Gets the path a file copied or moved to path should have: inside path if
+ * it names a directory or ends in a slash, or path itself otherwise.
+ * const string &path - where the file is going
+ * const char* name - the file's own name
+ */
+string volume::targetPath(const string &path, const char* name) {
+	lockTree(false);
+	string target = destinationPath(path, name);
+	unlockTree(false);
+	return target;
+}
+
+/* The same as targetPath, for calls that already hold the tree.
+ */
+string volume::destinationPath(const string &path, const char* name) {
+	if ((!path.empty() && path[path.length() - 1] == '/') || findDirectory(path) != -1) {
+		return path + "/" + name;
+	}
+	return path;
+}
+
+/* Writes a new directory entry into a directory, replacing a file that
+ * already has its name. Returns NULL on success, or a message saying why it
+ * couldn't be written.
+ * unsigned int dir - first cluster of the directory's table
+ * const string &name - the name of the file
+ * directory_entry* entry - the entry being written, apart from its name
+ * off_t &entry_index - set to the absolute index the entry was written to
+ */
+const char* volume::placeEntry(unsigned int dir, const string &name, directory_entry* entry, off_t &entry_index) {
+	if (name.empty()) return "A file name is needed.";
+	if (name.length() >= sizeof(entry->name)) return "File name is too long.";
+	entry_index = findEntry(dir, name);
+	if (entry_index != -1 && entryAddress(entry_index)->type == DIRECTORY_TYPE) {
+		return "A directory with that name exists.";
+	}
+	if (entry_index != -1) removeEntry(entry_index);
+	else entry_index = findAvailableEntry(dir, name.c_str());
+	if (entry_index == -1) return "Not enough free space in system.";
+	memset(entry->name, 0, sizeof(entry->name));
+	strcpy(entry->name, name.c_str());
+	writeEntry(entry_index, entry);
+	return NULL;
+}
+
+/* Makes an empty directory. Its table starts as one cluster of free entries.
+ * Returns false if it couldn't be made.
+ * const char* path - the path of the new directory
+ */
+bool volume::makeDirectory(const char* path) {
+	if (fs_mkdir(path) == 0) return true;
+	if (errno == ENOENT) cerr << "Directory does not exist." << endl;
+	else if (errno == EEXIST) cerr << "File exists." << endl;
+	else if (errno == ENAMETOOLONG) cerr << "File name is too long." << endl;
+	else cerr << "Not enough free space in system." << endl;
+	return false;
+}
+
+/* The same as makeDirectory, with errors reported in errno like mkdir.
+ * Returns 0, or -1 with errno set.
+ */
+int volume::fs_mkdir(const char* path) {
+	lockTree(true);
+	unsigned int dir;
+	string name;
+	int error = 0;
+	if (!resolvePath(path, dir, name)) error = ENOENT;
+	else if (name.empty() || findEntry(dir, name) != -1) error = EEXIST;
+	else if (name.length() >= sizeof(((directory_entry*)0)->name)) error = ENAMETOOLONG;
+	off_t entry_index = -1;
+	int new_index = -1;
+	if (error == 0) {
+		entry_index = findAvailableEntry(dir, name.c_str());
+		new_index = (entry_index == -1) ? -1 : findAvailableCluster();
+		if (new_index == -1) error = ENOSPC;
+	}
+	if (error != 0) {
+		unlockTree();
+		errno = error;
+		return -1;
+	}
+	setFAT(new_index, 0xFFFF);
+	newTable(new_index);
+	dir_owner[new_index] = new_index;
+	directories[new_index].parent = dir;
+	directory_entry entry;
+	memset(&entry, 0, sizeof(directory_entry));
+	strcpy(entry.name, name.c_str());
+	entry.index = new_index;
+	entry.size = 0;
+	entry.type = DIRECTORY_TYPE;
+	entry.creation = time(0);
+	writeEntry(entry_index, &entry);
+	unlockTree();
+	return 0;
+}
+
+/* Removes an empty directory and frees its table.
+ * const char* path - the path of the directory
+ */
+void volume::removeDirectory(const char* path) {
+	if (fs_rmdir(path) == 0) return;
+	if (errno == ENOENT) cerr << "Directory does not exist." << endl;
+	else if (errno == ENOTDIR) cerr << "Not a directory." << endl;
+	else cerr << "Directory is not empty." << endl;
+}
+
+/* The same as removeDirectory, with errors reported in errno like rmdir.
+ * Returns 0, or -1 with errno set.
+ */
+int volume::fs_rmdir(const char* path) {
+	lockTree(true);
+	off_t entry_index = fileEntry((char*)path);
+	int error = 0;
+	unsigned int first = 0;
+	if (entry_index == -1) error = ENOENT;
+	else {
+		directory_entry* entry = entryAddress(entry_index);
+		first = entry->index;
+		if (entry->type != DIRECTORY_TYPE || directories.count(first) == 0) error = ENOTDIR;
+		else if (!directoryEmpty(first)) error = ENOTEMPTY;
+	}
+	if (error != 0) {
+		unlockTree(false);
+		errno = error;
+		return -1;
+	}
+	if (cwd_index == first) cwd_index = directories[first].parent;
+	// Forget its tables, along with any changes to them not yet written
+	for (unsigned int cur_index = first; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+		free(dir_table[cur_index]);
+		dir_table.erase(cur_index);
+		dir_owner.erase(cur_index);
+		compact_tables.erase(cur_index);
+		dirty_entries.erase(dirty_entries.lower_bound((off_t)cur_index * cluster_size),
+				    dirty_entries.lower_bound((off_t)(cur_index + 1) * cluster_size));
+	}
+	freeTree(first);
+	directories.erase(first);
+	removeEntry(entry_index);
+	unlockTree();
+	return 0;
+}
+
+/* Makes a directory in the file system the current one.
+ * Returns false if the path doesn't name a directory.
+ * const char* path - the path of the directory
+ */
+bool volume::changeDirectory(const char* path) {
+	lockTree(true);
+	int dir = findDirectory(path);
+	if (dir == -1) {
+		cerr << "Directory does not exist." << endl;
+		unlockTree(false);
+		return false;
+	}
+	cwd_index = dir;
+	unlockTree(false);
+	return true;
+}
+
+/* Returns true if a directory is another one or is somewhere inside it.
+ * unsigned int dir - first cluster of the directory being checked
+ * unsigned int ancestor - first cluster of the directory it may be inside
+ */
+bool volume::insideDirectory(unsigned int dir, unsigned int ancestor) {
+	while (true) {
+		if (dir == ancestor) return true;
+		if (dir == root_index) return false;
+		dir = directories[dir].parent;
+	}
+}
+
+/* Gets the starting FAT index of a file in the file system.
+ * char* file_name - the path of the file
+ */
+int volume::fileIndex(char* const &file_name) {
+	off_t entry_index = fileEntry(file_name);
+	if (entry_index == -1) return -1;
+	return entryAddress(entry_index)->index;
+}
+
+/* Finds the index of a file in the directory tables.
+ * char* file_name - the path of the file
+ */
+off_t volume::fileEntry(char* const &file_name) {
+	unsigned int dir;
+	string name;
+	if (!resolvePath(file_name, dir, name) || name.empty()) return -1;
+	return findEntry(dir, name);
+}
+
+/* Returns true if none of a directory's table entries are in use. The table
+ * is looked at rather than the index, so a stale index can't hide an entry.
+ * unsigned int dir - first cluster of the directory's table
+ */
+bool volume::directoryEmpty(unsigned int dir) {
+	for (unsigned int cur_index = dir; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+		directory_entry* table = dir_table[cur_index];
+		for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+			if (table[i].name[0] != 0x00) return false;
+		}
+	}
+	return true;
+}
+
+/* Adds an entry, as it is in its table, to the index of its directory.
+ * off_t entry_index - absolute index of the entry in the file system
+ */
+void volume::indexEntry(off_t entry_index) {
+	unsigned int dir = dir_owner[entry_index / cluster_size];
+	directory_index &index = directories[dir];
+	directory_entry* entry = entryAddress(entry_index);
+	if (index.tree == NULL) {
+		index_entry ie;
+		ie.offset = entry_index;
+		ie.index = entry->index;
+		ie.size = entry->size;
+		ie.type = entry->type;
+		index.entries[entry->name] = ie;
+		return;
+	}
+	// The tree only keeps where the entry is, so it changes less often
+	unsigned long long offset;
+	if (index.tree->find(entry->name, offset) && offset == (unsigned long long)entry_index) return;
+	if (index.tree->insert(entry->name, entry_index)) dirty_trees.insert(dir);
+	else cerr << "Not enough free space to index '" << entry->name << "'; run fsck -r." << endl;
+}
+
+/* Removes an entry's name from the index of its directory.
+ * off_t entry_index - absolute index of the entry in the file system
+ */
+void volume::unindexEntry(off_t entry_index) {
+	unsigned int dir = dir_owner[entry_index / cluster_size];
+	directory_index &index = directories[dir];
+	directory_entry* entry = entryAddress(entry_index);
+	if (index.tree == NULL) index.entries.erase(entry->name);
+	else if (index.tree->erase(entry->name)) dirty_trees.insert(dir);
+}
+
+/* Builds the index of every directory from its table chain. Directories
+ * with a name B-tree already have their index in the image.
+ */
+void volume::buildIndex() {
+	for (unordered_map<unsigned int, directory_index>::iterator it = directories.begin(); it != directories.end(); it++) {
+		it->second.entries.clear();
+		if (it->second.tree != NULL) continue;
+		for (unsigned int cur_index = it->first; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+			directory_entry* table = dir_table[cur_index];
+			for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+				if (table[i].name[0] == 0x00) continue;
+				index_entry ie;
+				ie.offset = slotOffset(cur_index, i);
+				ie.index = table[i].index;
+				ie.size = table[i].size;
+				ie.type = table[i].type;
+				it->second.entries[table[i].name] = ie;
+			}
+		}
+	}
+}
+
+/* Writes a directory entry into its directory table and indexes it.
+ * off_t entry_index - absolute index of the entry in the file system
+ * directory_entry* entry - the entry being written
+ */
+void volume::writeEntry(off_t entry_index, directory_entry* entry) {
+	directory_entry* old_entry = entryAddress(entry_index);
+	if (old_entry->name[0] != 0x00) {
+		if (strcmp(old_entry->name, entry->name) != 0) unindexEntry(entry_index);
+		ref_count[old_entry->index]--;
+	}
+	// Another entry for a chain shares all of it
+	if (old_entry->name[0] == 0x00 || old_entry->index != entry->index) dropExtentMap(entry->index);
+	// A compact entry's name may now take more or fewer slots
+	releaseSlots(entry_index);
+	ref_count[entry->index]++;
+	memcpy(old_entry, entry, sizeof(directory_entry));
+	claimSlots(entry_index);
+	dirty_entries.insert(entry_index);
+	indexEntry(entry_index);
+}
+
+/* Clears a directory entry and removes it from the index.
+ * off_t entry_index - absolute index of the entry in the file system
+ */
+void volume::clearEntry(off_t entry_index) {
+	directory_entry* entry = entryAddress(entry_index);
+	unindexEntry(entry_index);
+	releaseSlots(entry_index);
+	ref_count[entry->index]--;
+	memset(entry, 0, sizeof(directory_entry));
+	dirty_entries.insert(entry_index);
+	// The next entry added to the directory can go here
+	directories[dir_owner[entry_index / cluster_size]].free_hint = entry_index / cluster_size;
+}
+
+/* Prints the current directory's table in a readable format.
+ */
+void volume::printDT() {
+	lockTree(true);
+	directory_entry* cur_entry;
+	int entry_count = 0;
+	int cur_index = cwd_index;
+	do {
+		directory_entry* new_table = dir_table[cur_index];
+		// Iterate across each entry and print its information; a compact
+		// table's header and the ends of long names aren't entries
+		for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+			cur_entry = &new_table[i];
+			if (cur_entry->type == RESERVED_SLOT) continue;
+			cout << "Entry " << entry_count++ << endl;
+			cout << "\tName: " << cur_entry->name << endl;
+			cout << "\tIndex: " << cur_entry->index << endl;
+			cout << "\tSize: " << cur_entry->size << endl;
+			cout << "\tType: " << cur_entry->type << endl;
+			cout << "\tCreation: " << cur_entry->creation << endl;
+		}
+		// Get the next table (if it exists)
+		cur_index = FileAllocationTable[cur_index];
+	} while (cur_index != 0xFFFF);
+	unlockTree(false);
+}
+
+/* Handles the 'ls' command and prints out files along with their information.
+ * unsigned int dir - first cluster of the directory being listed
+ */
+void volume::listContents(unsigned int dir) {
+	vector<off_t> entries;
+	directoryEntries(dir, entries);
+	for (unsigned int i = 0; i < entries.size(); i++) printEntry(entryAddress(entries[i]));
+}
+
+/* Finds the entries in use in a directory. Directories with a name B-tree
+ * give them in name order, and the others in table order.
+ * unsigned int dir - first cluster of the directory's table
+ * vector<off_t> &entries - the absolute indices of the entries
+ */
+void volume::directoryEntries(unsigned int dir, vector<off_t> &entries) {
+	if (directories[dir].tree != NULL) {
+		vector<unsigned long long> offsets;
+		directories[dir].tree->list(offsets);
+		for (unsigned int i = 0; i < offsets.size(); i++) {
+			unordered_map<unsigned int, unsigned int>::iterator owner = dir_owner.find(offsets[i] / cluster_size);
+			if (owner == dir_owner.end() || owner->second != dir) continue;
+			if (entryAddress(offsets[i])->name[0] != 0x00) entries.push_back(offsets[i]);
+		}
+		return;
+	}
+	int cur_index = dir;
+	do {
+		directory_entry* table = dir_table[cur_index];
+		// Free slots, a compact table's header and the ends of long names
+		// have no name
+		for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+			if (table[i].name[0] != 0x00) entries.push_back(slotOffset(cur_index, i));
+		}
+		cur_index = FileAllocationTable[cur_index];
+	} while (cur_index != 0xFFFF);
+}
+
+/* Prints one line of 'ls' for an entry, unless the entry is free.
+ * directory_entry* entry - the entry being printed
+ */
+void volume::printEntry(directory_entry* entry) {
+	if (strcmp(entry->name, "") == 0) return;
+	// A directory's size field holds its name B-tree, not a size
+	cout << setw(15) << (entry->type == DIRECTORY_TYPE ? 0 : entry->size);
+	cout << setw(20) << entry->name;
+	cout << setw(10) << entry->type;
+	time_t the_time(entry->creation);
+	cout << setw(40) << asctime(localtime(&the_time));
+}
+
+/* Prints out occupied indices in the FAT in a readable format.
+ */
+void volume::printFAT() {
+	lockTree(true);
+	cout << "Printing occupied entries in FAT table" << endl;
+	for (unsigned int i = 0; i < num_clusters; i++) {
+		int index = FileAllocationTable[i];
+		// If non-empty, print out index it points to
+		if (index != 0) {
+			cout << i << ": " << index << endl;
+		}
+	}
+	unlockTree(false);
+}
+
+/* Claims a cluster that is available for use within the system; the caller
+ * links it into the FAT, or frees it with setFAT if it isn't needed after all.
+ * int hint - the search starts here, so a file being written gets the cluster
+ *            after its last one when it is free; -1 starts in the calling
+ *            thread's own part of the file system
+ */
+int volume::findAvailableCluster(int hint) {
+	// Return -1 if there are no available clusters.
+	return free_map->claim(hint);
+}
+
+/* Update the FAT at a given index, write the data, and return an available index.
+ * int writeIndex - the index that is being updated
+ */
+int volume::writeFATRecord(int writeIndex) {
+	// Find an available cluster, update the FAT, and return the available cluster index
+	int nextIndex = findAvailableCluster(writeIndex + 1);
+	if (nextIndex == -1) return nextIndex;
+	setFAT(writeIndex, nextIndex);
+	setFAT(nextIndex, 0xFFFF);
+	return nextIndex;
+}
+
+/* Allocates clusters for a file and links them into one chain in the FAT.
+ * Returns the first cluster of the chain, or -1 if there is not enough space.
+ * int count - the number of clusters needed
+ * vector<cluster_extent> &extents - filled with the contiguous runs that were allocated
+ */
+int volume::allocateExtents(int count, vector<cluster_extent> &extents) {
+	if (!free_map->allocate(count, -1, extents)) return -1;
+	return linkExtents(extents);
+}
+
+/* Links runs of clusters claimed from the allocator into one chain in the
+ * FAT. Returns the first cluster of the chain.
+ * vector<cluster_extent> &extents - the runs, in chain order
+ */
+int volume::linkExtents(vector<cluster_extent> &extents) {
+	for (unsigned int i = 0; i < extents.size(); i++) {
+		unsigned int last = extents[i].start + extents[i].length - 1;
+		for (unsigned int j = extents[i].start; j < last; j++) {
+			setFAT(j, j + 1);
+		}
+		// The last cluster of each run links to the start of the next one
+		if (i + 1 < extents.size()) setFAT(last, extents[i + 1].start);
+		else setFAT(last, 0xFFFF);
+	}
+	return extents[0].start;
+}
+
+/* Sets a FAT entry and marks the cluster used or free in the bitmap.
+ * int index - the FAT entry being updated
+ * unsigned int value - the next cluster in the chain, 0xFFFF, or 0x0000 for free
+ */
+void volume::setFAT(int index, unsigned int value) {
+	// Keep the reference counts of the clusters being linked and unlinked
+	unsigned int old_value = FileAllocationTable[index];
+	if (old_value != 0x0000 && old_value != 0xFFFF && old_value < num_clusters) ref_count[old_value]--;
+	// New chains are made of free clusters and a chain that grows keeps its
+	// runs, so only other changes to clusters in use change a file's extents
+	bool grows = (old_value == 0xFFFF && value != 0x0000 && value != 0xFFFF);
+	if (old_value != 0x0000 && !grows && !extent_maps.empty()) dropExtentMaps();
+	if (value != 0x0000 && value != 0xFFFF) ref_count[value]++;
+	FileAllocationTable[index] = value;
+	FAT_dirty[index / FAT_CHUNK] = 1;
+	if (value == 0x0000) free_map->clear(index);
+	else free_map->set(index);
+}
+
+/* Allocates the in-memory FAT and everything kept alongside it, sized for
+ * num_clusters. Every cluster starts out free apart from the reserved ones.
+ */
+void volume::initTables() {
+	int num_chunks = num_clusters / FAT_CHUNK + 1;
+	FileAllocationTable = (unsigned int*)calloc((size_t)FAT_clusters * cluster_size + sizeof(unsigned int), sizeof(char));
+	FAT_dirty = (char*)calloc(num_chunks, sizeof(char));
+	FAT_present = (char*)calloc(num_chunks, sizeof(char));
+	ref_count = (unsigned int*)calloc(num_clusters, sizeof(unsigned int));
+	free_map = new cluster_allocator(num_clusters, ALLOC_SHARDS);
+	// The boot record, FAT and root table are always in use, and the
+	// indices that collide with the end-of-chain markers are never handed out
+	free_map->set(0);
+	free_map->set(FAT_index);
+	free_map->set(root_index);
+	if (num_clusters > 0xFFFE) free_map->set(0xFFFE);
+	if (num_clusters > 0xFFFF) free_map->set(0xFFFF);
+}
+
+/* Counts the references to every cluster from the FAT and the directory tables.
+ */
+void volume::buildRefCounts() {
+	// The FAT, root directory table and journal are referred to by the boot
+	// record, and name B-trees by their directory
+	ref_count[FAT_index] = 1;
+	ref_count[root_index] = 1;
+	if (journal_index != 0) ref_count[journal_index] = 1;
+	for (unordered_map<unsigned int, directory_index>::iterator dir = directories.begin(); dir != directories.end(); dir++) {
+		if (dir->second.tree != NULL) ref_count[dir->second.tree->getRoot()]++;
+	}
+	for (unsigned int i = 0; i < num_clusters; i++) {
+		// Chunks that were holes in the image have no links
+		if (i % FAT_CHUNK == 0 && !FAT_present[i / FAT_CHUNK]) {
+			i += FAT_CHUNK - 1;
+			continue;
+		}
+		unsigned int next_index = FileAllocationTable[i];
+		if (next_index != 0x0000 && next_index != 0xFFFF && next_index < num_clusters) {
+			ref_count[next_index]++;
+		}
+	}
+	for (unordered_map<unsigned int, directory_entry*>::iterator it = dir_table.begin(); it != dir_table.end(); it++) {
+		for (unsigned int i = 0; i < tableSlots(it->first); i++) {
+			if (it->second[i].name[0] != 0x00 && it->second[i].index < num_clusters) ref_count[it->second[i].index]++;
+		}
+	}
+}
+
+/* Marks the clusters that are in use in the free-cluster bitmap.
+ */
+void volume::buildFreeMap() {
+	for (unsigned int i = 0; i < num_clusters; i++) {
+		// Chunks that were holes in the image are all free
+		if (i % FAT_CHUNK == 0 && !FAT_present[i / FAT_CHUNK]) {
+			i += FAT_CHUNK - 1;
+			continue;
+		}
+		if (FileAllocationTable[i] != 0x0000) free_map->set(i);
+	}
+}
+
+/* Opens the file system image and maps it into memory. The handle stays open
+ * until closeImage is called, so cluster access never has to reopen the file.
+ * Returns false if the image does not exist or cannot be mapped.
+ */
+bool volume::openImage() {
+	fs_fd = open(image_path.c_str(), O_RDWR);
+	if (fs_fd == -1) return false;
+	struct stat st;
+	fstat(fs_fd, &st);
+	fs_image_size = st.st_size;
+	fs_image = (char*)mmap(NULL, fs_image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, 0);
+	if (fs_image == MAP_FAILED) {
+		close(fs_fd);
+		fs_fd = -1;
+		fs_image = NULL;
+		return false;
+	}
+	return true;
+}
+
+/* Writes back the mapped view and closes the image handle.
+ */
+void volume::closeImage() {
+	if (fs_image == NULL) return;
+	msync(fs_image, fs_image_size, MS_SYNC);
+	munmap(fs_image, fs_image_size);
+	close(fs_fd);
+	fs_image = NULL;
+	fs_fd = -1;
+}
+
+/* Returns a pointer to the start of a cluster inside the mapped image.
+ * int clusterIndex - the index of the cluster
+ */
+char* volume::clusterAddress(int clusterIndex) {
+	return fs_image + (size_t)clusterIndex * cluster_size;
+}
+
+/* Passes advice about a run of clusters in the mapped image to the kernel.
+ * unsigned int start - the first cluster of the run
+ * unsigned int count - the number of clusters in the run
+ * int advice - one of the MADV_ values
+ */
+void volume::adviseClusters(unsigned int start, unsigned int count, int advice) {
+	// madvise works on whole pages
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t first = (size_t)start * cluster_size / page_size * page_size;
+	size_t last = (size_t)(start + count) * cluster_size;
+	madvise(fs_image + first, last - first, advice);
+}
+
+/* Records a use of a cluster in the cache. If it wasn't cached, the kernel is
+ * asked to read it and the next read_ahead clusters of its chain now, so the
+ * reads that follow don't wait on the disk one cluster at a time.
+ * int clusterIndex - the cluster being read or written
+ */
+void volume::cacheCluster(int clusterIndex) {
+	if (cache->access(clusterIndex)) return;
+	vector<cluster_extent> runs;
+	cluster_extent run = { (unsigned int)clusterIndex, 1 };
+	runs.push_back(run);
+	unsigned int next_index = FileAllocationTable[clusterIndex];
+	for (int i = 0; i < read_ahead && next_index != 0xFFFF && next_index != 0x0000; i++) {
+		if (!cache->contains(next_index)) {
+			cache->insert(next_index);
+			// Neighbouring clusters are asked for together
+			if (runs.back().start + runs.back().length == next_index) {
+				runs.back().length++;
+			} else {
+				cluster_extent next_run = { next_index, 1 };
+				runs.push_back(next_run);
+			}
+		}
+		next_index = FileAllocationTable[next_index];
+	}
+	for (unsigned int i = 0; i < runs.size(); i++) {
+		adviseClusters(runs[i].start, runs[i].length, MADV_WILLNEED);
+	}
+}
+
+/* Called by the cache when a cluster is evicted. Its pages are left in the
+ * page cache but marked as the first ones to reclaim.
+ * void* context - the volume the cache belongs to
+ * int clusterIndex - the cluster that was evicted
+ */
+void volume::releaseCluster(void* context, int clusterIndex) {
+#ifdef MADV_COLD
+	((volume*)context)->adviseClusters(clusterIndex, 1, MADV_COLD);
+#endif
+}
+
+/* Returns a pointer to a directory entry in the in-memory directory table.
+ * off_t entry_index - absolute index of the entry in the file system
+ */
+directory_entry* volume::entryAddress(off_t entry_index) {
+	unsigned int cluster = entry_index / cluster_size;
+	return dir_table[cluster] + (entry_index % cluster_size) / slotSize(cluster);
+}
+
+/* Returns the size of the slots in a directory table cluster.
+ * unsigned int cluster - the table cluster
+ */
+unsigned int volume::slotSize(unsigned int cluster) {
+	return compact_tables.count(cluster) != 0 ? sizeof(compact_entry) : sizeof(directory_entry);
+}
+
+/* Returns the number of slots in a directory table cluster.
+ * unsigned int cluster - the table cluster
+ */
+unsigned int volume::tableSlots(unsigned int cluster) {
+	return cluster_size / slotSize(cluster);
+}
+
+/* Returns the absolute index of a slot in a directory table cluster.
+ * unsigned int cluster - the table cluster
+ * unsigned int slot - the slot in the cluster
+ */
+off_t volume::slotOffset(unsigned int cluster, unsigned int slot) {
+	return (off_t)cluster * cluster_size + (off_t)slot * slotSize(cluster);
+}
+
+/* Returns the number of consecutive slots an entry with a name takes up.
+ * unsigned int cluster - the table cluster the entry would go in
+ * const char* name - the entry's name
+ */
+unsigned int volume::slotsNeeded(unsigned int cluster, const char* name) {
+	if (compact_tables.count(cluster) == 0) return 1;
+	return compactSlots(name);
+}
+
+/* Returns the number of compact slots an entry with a name takes up.
+ * const char* name - the entry's name
+ */
+unsigned int volume::compactSlots(const char* name) {
+	unsigned int length = strlen(name);
+	unsigned int inline_length = sizeof(((compact_entry*)0)->name);
+	if (length <= inline_length) return 1;
+	return 1 + (length - inline_length + sizeof(compact_entry) - 1) / sizeof(compact_entry);
+}
+
+/* Makes a cluster an empty directory table in the format the boot record
+ * asks for. All of it has to reach the image.
+ * unsigned int cluster - the new table cluster
+ */
+void volume::newTable(unsigned int cluster) {
+	if (dir_table.count(cluster) != 0) free(dir_table[cluster]);
+	if (bootrecord[9] == COMPACT_FORMAT) compact_tables.insert(cluster);
+	else compact_tables.erase(cluster);
+	dir_table[cluster] = (directory_entry*)calloc(tableSlots(cluster), sizeof(directory_entry));
+	if (compact_tables.count(cluster) != 0) dir_table[cluster][0].type = RESERVED_SLOT;
+	for (unsigned int i = 0; i < tableSlots(cluster); i++) {
+		dirty_entries.insert(slotOffset(cluster, i));
+	}
+}
+
+/* Loads a directory table cluster from the image into memory, expanding
+ * compact entries to one directory_entry per slot.
+ * unsigned int cluster - the table cluster
+ */
+void volume::loadTable(unsigned int cluster) {
+	char* data = clusterAddress(cluster);
+	compact_header* header = (compact_header*)data;
+	if (memcmp(header->magic, COMPACT_MAGIC, sizeof(header->magic)) == 0 && header->version == COMPACT_FORMAT) {
+		compact_tables.insert(cluster);
+	}
+	else compact_tables.erase(cluster);
+	unsigned int slots = tableSlots(cluster);
+	directory_entry* table = (directory_entry*)calloc(slots, sizeof(directory_entry));
+	dir_table[cluster] = table;
+	if (compact_tables.count(cluster) == 0) {
+		memcpy(table, data, cluster_size);
+		return;
+	}
+	table[0].type = RESERVED_SLOT;
+	compact_entry* compact = (compact_entry*)data;
+	for (unsigned int i = 1; i < slots; i++) {
+		if (compact[i].length == 0) continue;
+		// A name that claims more slots than are left is cut short
+		unsigned int extra = compact[i].extra;
+		if (extra > slots - 1 - i) extra = slots - 1 - i;
+		unsigned int length = compact[i].length;
+		unsigned int room = sizeof(compact[i].name) + extra * sizeof(compact_entry);
+		if (length > room) length = room;
+		if (length >= sizeof(table[i].name)) length = sizeof(table[i].name) - 1;
+		table[i].index = compact[i].index;
+		table[i].size = compact[i].size;
+		table[i].type = compact[i].type;
+		table[i].creation = compact[i].creation;
+		// The rest of the name runs on through the slots after the entry
+		memcpy(table[i].name, compact[i].name, length);
+		for (unsigned int j = 1; j <= extra; j++) {
+			table[i + j].type = RESERVED_SLOT;
+			table[i + j].index = i;
+			table[i + j].size = j;
+		}
+		i += extra;
+	}
+}
+
+/* Writes one slot of a directory table cluster in its image format.
+ * unsigned int cluster - the table cluster
+ * unsigned int slot - the slot in the cluster
+ * char* data - where the slot is written, slotSize bytes
+ */
+void volume::encodeSlot(unsigned int cluster, unsigned int slot, char* data) {
+	directory_entry* entry = &dir_table[cluster][slot];
+	if (compact_tables.count(cluster) == 0) {
+		memcpy(data, entry, sizeof(directory_entry));
+		return;
+	}
+	memset(data, 0, sizeof(compact_entry));
+	if (slot == 0) {
+		compact_header* header = (compact_header*)data;
+		memcpy(header->magic, COMPACT_MAGIC, sizeof(header->magic));
+		header->version = COMPACT_FORMAT;
+		return;
+	}
+	// The end of a long name, a slot's worth at a time
+	if (entry->type == RESERVED_SLOT) {
+		directory_entry* owner = &dir_table[cluster][entry->index];
+		memcpy(data, owner->name + sizeof(((compact_entry*)0)->name) + (entry->size - 1) * sizeof(compact_entry),
+		       sizeof(compact_entry));
+		return;
+	}
+	if (entry->name[0] == 0x00) return;
+	compact_entry* compact = (compact_entry*)data;
+	compact->index = entry->index;
+	compact->size = entry->size;
+	compact->creation = entry->creation;
+	compact->type = entry->type;
+	compact->length = strlen(entry->name);
+	compact->extra = slotsNeeded(cluster, entry->name) - 1;
+	memcpy(compact->name, entry->name, sizeof(compact->name));
+}
+
+/* Writes a whole directory table cluster in its image format.
+ * unsigned int cluster - the table cluster
+ * char* data - where the cluster is written
+ */
+void volume::encodeTable(unsigned int cluster, char* data) {
+	for (unsigned int i = 0; i < tableSlots(cluster); i++) {
+		encodeSlot(cluster, i, data + i * slotSize(cluster));
+	}
+}
+
+/* Reserves the slots after a compact entry that hold the end of its name.
+ * They have to be free.
+ * off_t entry_index - absolute index of the entry in the file system
+ */
+void volume::claimSlots(off_t entry_index) {
+	unsigned int cluster = entry_index / cluster_size;
+	unsigned int slot = (entry_index % cluster_size) / slotSize(cluster);
+	unsigned int needed = slotsNeeded(cluster, dir_table[cluster][slot].name);
+	for (unsigned int j = 1; j < needed && slot + j < tableSlots(cluster); j++) {
+		directory_entry* piece = &dir_table[cluster][slot + j];
+		memset(piece, 0, sizeof(directory_entry));
+		piece->type = RESERVED_SLOT;
+		piece->index = slot;
+		piece->size = j;
+		dirty_entries.insert(slotOffset(cluster, slot + j));
+	}
+}
+
+/* Frees the slots after a compact entry that hold the end of its name.
+ * off_t entry_index - absolute index of the entry in the file system
+ */
+void volume::releaseSlots(off_t entry_index) {
+	unsigned int cluster = entry_index / cluster_size;
+	if (compact_tables.count(cluster) == 0) return;
+	unsigned int slot = (entry_index % cluster_size) / sizeof(compact_entry);
+	directory_entry* table = dir_table[cluster];
+	for (unsigned int j = slot + 1; j < tableSlots(cluster) && table[j].type == RESERVED_SLOT && table[j].index == slot; j++) {
+		memset(&table[j], 0, sizeof(directory_entry));
+		dirty_entries.insert(slotOffset(cluster, j));
+	}
+}
+
+/* Moves every directory table cluster that is still in the classic format to
+ * the compact one, and makes new tables compact. Each cluster is committed
+ * on its own, so if this is cut short the directories are left with some
+ * clusters in each format, which works since every cluster says which
+ * format it is in.
+ */
+void volume::convertTables() {
+	lockTree(true);
+	commitGroup();
+	if (bootrecord[9] != COMPACT_FORMAT) {
+		bootrecord[9] = COMPACT_FORMAT;
+		boot_dirty = true;
+	}
+	set<unsigned int> classic;
+	for (unordered_map<unsigned int, directory_entry*>::iterator it = dir_table.begin(); it != dir_table.end(); it++) {
+		if (compact_tables.count(it->first) == 0) classic.insert(it->first);
+	}
+	int converted = 0;
+	for (set<unsigned int>::iterator it = classic.begin(); it != classic.end(); it++) {
+		unsigned int cluster = *it;
+		vector<directory_entry> entries;
+		unsigned int needed = 0;
+		for (unsigned int i = 0; i < tableSlots(cluster); i++) {
+			directory_entry* entry = &dir_table[cluster][i];
+			if (entry->name[0] == 0x00) continue;
+			entries.push_back(*entry);
+			needed += compactSlots(entry->name);
+		}
+		// Entries with long names may not all fit back, and the ones
+		// that don't need a new cluster
+		if (needed > cluster_size / sizeof(compact_entry) - 1 && free_map->getFree() == 0) {
+			cerr << "Not enough free space in system." << endl;
+			break;
+		}
+		// Open files follow their entries; an entry can land where
+		// another one was, so they are all found before anything moves
+		vector<pair<int, int> > opened;
+		int entry_count = 0;
+		for (unsigned int i = 0; i < tableSlots(cluster); i++) {
+			if (dir_table[cluster][i].name[0] == 0x00) continue;
+			for (unsigned int fd = 0; fd < open_files.size(); fd++) {
+				if (open_files[fd].in_use && open_files[fd].entry_index == slotOffset(cluster, i)) {
+					opened.push_back(make_pair(fd, entry_count));
+				}
+			}
+			entry_count++;
+			clearEntry(slotOffset(cluster, i));
+		}
+		// Forget the classic slots before the cluster changes format
+		dirty_entries.erase(dirty_entries.lower_bound((off_t)cluster * cluster_size),
+				    dirty_entries.lower_bound((off_t)(cluster + 1) * cluster_size));
+		newTable(cluster);
+		unsigned int dir = dir_owner[cluster];
+		vector<off_t> placed(entries.size());
+		for (unsigned int i = 0; i < entries.size(); i++) {
+			off_t entry_index = freeEntry(cluster, entries[i].name);
+			if (entry_index == -1) entry_index = findAvailableEntry(dir, entries[i].name);
+			writeEntry(entry_index, &entries[i]);
+			placed[i] = entry_index;
+		}
+		for (unsigned int i = 0; i < opened.size(); i++) open_files[opened[i].first].entry_index = placed[opened[i].second];
+		commitGroup();
+		converted++;
+	}
+	commitGroup();
+	unlockTree(false);
+	cout << "Converted " << converted << " directory table clusters." << endl;
+}
+
+/* Splits the part of a file's chain that holds size bytes from offset on into
+ * runs of consecutive clusters. The first run starts at the cluster that
+ * holds offset. Reads that reach far into the file use its extent map, and
+ * short ones follow the chain.
+ * unsigned int start - the first cluster of the file
+ * unsigned int offset - where in the file the wanted bytes start
+ * unsigned int size - the number of bytes of the file that are wanted
+ * vector<cluster_extent> &extents - the runs, in file order
+ */
+void volume::chainExtents(unsigned int start, unsigned int offset, unsigned int size, vector<cluster_extent> &extents) {
+	if (size == 0) return;
+	unsigned int position = offset / cluster_size;
+	int left = ((off_t)offset + size - 1) / cluster_size - position + 1;
+	if (position + left > EXTENT_MIN_CLUSTERS) {
+		fileExtents(start)->runs(position, left, extents);
+		return;
+	}
+	unsigned int cur_index = start;
+	for (unsigned int i = 0; i < position && cur_index != 0xFFFF; i++) cur_index = FileAllocationTable[cur_index];
+	while (cur_index != 0xFFFF && left > 0) {
+		if (!extents.empty() && extents.back().start + extents.back().length == cur_index) {
+			extents.back().length++;
+		} else {
+			cluster_extent run = { cur_index, 1 };
+			extents.push_back(run);
+		}
+		cur_index = FileAllocationTable[cur_index];
+		left--;
+	}
+}
+
+/* Returns the extent map of a file, building it from the file's chain if
+ * it isn't kept already.
+ * unsigned int start - the first cluster of the file
+ */
+extent_map* volume::fileExtents(unsigned int start) {
+	unordered_map<unsigned int, extent_map*>::iterator it = extent_maps.find(start);
+	if (it != extent_maps.end()) {
+		it->second->extend(FileAllocationTable, ref_count, num_clusters);
+		return it->second;
+	}
+	if (extent_maps.size() >= MAX_EXTENT_MAPS) dropExtentMaps();
+	extent_map* map = new extent_map(start, FileAllocationTable, ref_count, num_clusters);
+	extent_maps[start] = map;
+	return map;
+}
+
+/* Forgets every extent map; they are built again as files are read.
+ */
+void volume::dropExtentMaps() {
+	for (unordered_map<unsigned int, extent_map*>::iterator it = extent_maps.begin(); it != extent_maps.end(); it++) {
+		delete it->second;
+	}
+	extent_maps.clear();
+}
+
+/* Forgets the extent map of one file.
+ * unsigned int start - the first cluster of the file
+ */
+void volume::dropExtentMap(unsigned int start) {
+	unordered_map<unsigned int, extent_map*>::iterator it = extent_maps.find(start);
+	if (it == extent_maps.end()) return;
+	delete it->second;
+	extent_maps.erase(it);
+}
+
+/* Queues the copy of part of a host file into a run of clusters in the
+ * image. The host file is read straight into the mapped image.
+ * int host_fd, off_t host_offset - where the data is read from
+ * cluster_extent run - the clusters the data is written to
+ * size_t size - the number of bytes to copy
+ * vector<io_request> &batch - the batch the reads are added to
+ */
+void volume::importExtent(int host_fd, off_t host_offset, cluster_extent run, size_t size, vector<io_request> &batch) {
+	queueTransfer(batch, IO_READ, host_fd, clusterAddress(run.start), size, host_offset);
+}
+
+/* Queues the copy of a run of clusters in the image out to a host file. The
+ * host file is written straight from the mapped image.
+ * cluster_extent run - the clusters the data is read from
+ * int host_fd, off_t host_offset - where the data is written to
+ * size_t size - the number of bytes to copy
+ * vector<io_request> &batch - the batch the writes are added to
+ */
+void volume::exportExtent(cluster_extent run, int host_fd, off_t host_offset, size_t size, vector<io_request> &batch) {
+	queueTransfer(batch, IO_WRITE, host_fd, clusterAddress(run.start), size, host_offset);
+}
+
+/* Adds a transfer to a batch for the I/O engine, split into requests of at
+ * most MAX_IO_CLUSTERS clusters so the engine can work on several at once.
+ * vector<io_request> &batch - the batch the requests are added to
+ * int op - IO_READ or IO_WRITE
+ * int fd - the file that is read or written
+ * char* buffer - where the data is read into or written from
+ * size_t length - the number of bytes to transfer
+ * off_t offset - where in the file the transfer starts
+ */
+void volume::queueTransfer(vector<io_request> &batch, int op, int fd, char* buffer, size_t length, off_t offset) {
+	size_t max_length = (size_t)MAX_IO_CLUSTERS * cluster_size;
+	while (length > 0) {
+		io_request request;
+		memset(&request, 0, sizeof(request));
+		request.op = op;
+		request.fd = fd;
+		request.buffer = buffer;
+		request.length = length < max_length ? length : max_length;
+		request.offset = offset;
+		batch.push_back(request);
+		buffer += request.length;
+		offset += request.length;
+		length -= request.length;
+	}
+}
+
+/* Prints runs of clusters from rangeExtents to standard output. The chain is
+ * read from the image through the I/O engine a buffer at a time, and each
+ * buffer is printed once its batch has been reaped.
+ * vector<cluster_extent> &extents - the runs, in file order
+ * size_t skip - where in the first cluster printing starts
+ * size_t count - the number of bytes to print
+ */
+void volume::printFile(vector<cluster_extent> &extents, size_t skip, size_t count) {
+	size_t buffer_size = (size_t)IO_DEPTH * MAX_IO_CLUSTERS * cluster_size;
+	char* buffer = (char*)malloc(buffer_size);
+	vector<io_request> batch;
+	size_t used = 0;
+	for (unsigned int i = 0; i < extents.size() && count > 0; i++) {
+		off_t image_offset = (off_t)extents[i].start * cluster_size + skip;
+		size_t length = (size_t)extents[i].length * cluster_size - skip;
+		if (count < length) length = count;
+		count -= length;
+		skip = 0;
+		while (length > 0) {
+			size_t part = buffer_size - used < length ? buffer_size - used : length;
+			queueTransfer(batch, IO_READ, fs_fd, buffer + used, part, image_offset);
+			used += part;
+			image_offset += part;
+			length -= part;
+			if (used < buffer_size) continue;
+			printBatch(batch);
+			used = 0;
+		}
+	}
+	printBatch(batch);
+	free(buffer);
+}
+
+/* Runs a batch of reads on the I/O engine and prints what they read, in
+ * order. Only the engine is locked, and only while the batch runs.
+ * vector<io_request> &batch - the reads; emptied once they are printed
+ */
+void volume::printBatch(vector<io_request> &batch) {
+	pthread_mutex_lock(&io_lock);
+	io->run(batch);
+	pthread_mutex_unlock(&io_lock);
+	for (unsigned int i = 0; i < batch.size(); i++) {
+		if (batch[i].result > 0) cout.write(batch[i].buffer, batch[i].result);
+	}
+	batch.clear();
+}
+
+/* Zero-fills runs of clusters in the image with one batch of writes on the
+ * I/O engine, all of them from the same buffer of zeros.
+ * vector<cluster_extent> &runs - the clusters to zero
+ */
+void volume::zeroClusters(vector<cluster_extent> &runs) {
+	size_t max_length = (size_t)MAX_IO_CLUSTERS * cluster_size;
+	char* zeros = (char*)calloc(max_length, sizeof(char));
+	vector<io_request> batch;
+	for (unsigned int i = 0; i < runs.size(); i++) {
+		off_t offset = (off_t)runs[i].start * cluster_size;
+		size_t length = (size_t)runs[i].length * cluster_size;
+		while (length > 0) {
+			size_t part = length < max_length ? length : max_length;
+			queueTransfer(batch, IO_WRITE, fs_fd, zeros, part, offset);
+			offset += part;
+			length -= part;
+		}
+	}
+	pthread_mutex_lock(&io_lock);
+	io->run(batch);
+	pthread_mutex_unlock(&io_lock);
+	free(zeros);
+}
+
+/* Finds a free entry in one cluster of a directory table, or returns -1.
+ * The cluster is remembered as the place to look first next time.
+ * unsigned int cluster - the table cluster to look in
+ * const char* name - the name of the entry, which in a compact table needs
+ *                    enough free slots in a row to hold it
+ */
+off_t volume::freeEntry(unsigned int cluster, const char* name) {
+	directory_entry* table = dir_table[cluster];
+	unsigned int needed = slotsNeeded(cluster, name);
+	unsigned int run = 0;
+	for (unsigned int i = 0; i < tableSlots(cluster); i++) {
+		if (table[i].name[0] != 0x00 || table[i].type == RESERVED_SLOT) {
+			run = 0;
+			continue;
+		}
+		if (++run == needed) {
+			directories[dir_owner[cluster]].free_hint = cluster;
+			return slotOffset(cluster, i - needed + 1);
+		}
+	}
+	return -1;
+}
+
+/* Finds an available entry in a directory's table, adding a cluster to the
+ * table if it is full. The search starts where a free entry was last seen
+ * and goes round to the start of the chain.
+ * unsigned int dir - first cluster of the directory's table
+ * bool grow - add a cluster if the table is full; a table only grows while
+ *             the tree is held exclusively
+ */
+off_t volume::findAvailableEntry(unsigned int dir, const char* name, bool grow) {
+	directory_index &index = directories[dir];
+	unsigned int start = dir;
+	if (index.free_hint != 0 && dir_owner.count(index.free_hint) != 0 && dir_owner[index.free_hint] == dir) {
+		start = index.free_hint;
+	}
+	int cur_index = start;
+	while (true) {
+		off_t entry_index = freeEntry(cur_index, name);
+		if (entry_index != -1) return entry_index;
+		if (FileAllocationTable[cur_index] == 0xFFFF) break;
+		cur_index = FileAllocationTable[cur_index];
+	}
+	for (unsigned int wrap_index = dir; wrap_index != start; wrap_index = FileAllocationTable[wrap_index]) {
+		off_t entry_index = freeEntry(wrap_index, name);
+		if (entry_index != -1) return entry_index;
+	}
+	if (!grow) return -1;
+	// If no entry is found, then make a new directory table
+	// If a directory table cannot be created, return -1
+	// Otherwise return the index of the new directory table
+	int new_index = writeFATRecord(cur_index);
+	if (new_index == -1) return new_index;
+	// The new table starts out empty, and all of it has to reach the image
+	newTable(new_index);
+	dir_owner[new_index] = dir;
+	return freeEntry(new_index, name);
+}
+
+/* Loads every directory table chain from the image into memory, starting
+ * with the root and following the directory entries in each table.
+ */
+void volume::updateDT() {
+	vector<unsigned int> pending(1, root_index);
+	loadDirectory(root_index, root_index, bootrecord[8]);
+	while (!pending.empty()) {
+		unsigned int dir = pending.back();
+		pending.pop_back();
+		for (unsigned int cur_index = dir; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+			directory_entry* table = dir_table[cur_index];
+			for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+				if (table[i].name[0] == 0x00 || table[i].type != DIRECTORY_TYPE) continue;
+				// Entries that lead nowhere or to a table already loaded are
+				// left for fsck
+				unsigned int child = table[i].index;
+				if (child >= num_clusters || FileAllocationTable[child] == 0x0000 || dir_table.count(child) != 0) continue;
+				loadDirectory(child, dir, table[i].size);
+				pending.push_back(child);
+			}
+		}
+	}
+}
+
+/* Loads one directory table chain from the image into memory, along with
+ * its name B-tree if it has one.
+ * unsigned int first - the first cluster of the chain
+ * unsigned int parent - first cluster of the directory that holds it
+ * unsigned int tree_root - root node of its name B-tree, 0 if it has none
+ */
+void volume::loadDirectory(unsigned int first, unsigned int parent, unsigned int tree_root) {
+	directories[first].parent = parent;
+	unsigned int cur_index = first;
+	while (true) {
+		loadTable(cur_index);
+		dir_owner[cur_index] = first;
+		unsigned int next_index = FileAllocationTable[cur_index];
+		if (next_index == 0xFFFF) break;
+		// A damaged chain would never end, so it is cut where it goes wrong
+		if (next_index >= num_clusters || FileAllocationTable[next_index] == 0x0000 || dir_table.count(next_index) != 0) {
+			cerr << "Directory table chain is damaged and was cut short." << endl;
+			FileAllocationTable[cur_index] = 0xFFFF;
+			FAT_dirty[cur_index / FAT_CHUNK] = 1;
+			break;
+		}
+		cur_index = next_index;
+	}
+	loadTree(first, tree_root);
+}
+
+/* Loads a directory's name B-tree from the image. A tree whose root isn't a
+ * cluster in use is ignored, and the directory is indexed at mount instead.
+ * unsigned int dir - first cluster of the directory's table
+ * unsigned int tree_root - root node of the tree, 0 if there is none
+ */
+void volume::loadTree(unsigned int dir, unsigned int tree_root) {
+	if (tree_root == 0) return;
+	if (tree_root >= num_clusters || FileAllocationTable[tree_root] == 0x0000 || dir_table.count(tree_root) != 0) {
+		cerr << "Directory index is damaged and was ignored." << endl;
+		return;
+	}
+	btree* tree = new btree(cluster_size, tree_root, allocateNode, this);
+	// The nodes are chained together in the FAT like a file
+	unsigned int count = 0;
+	for (unsigned int cur_index = tree_root; cur_index != 0xFFFF && cur_index < num_clusters && count < num_clusters;
+	     cur_index = FileAllocationTable[cur_index]) {
+		tree->load(cur_index, clusterAddress(cur_index));
+		count++;
+	}
+	directories[dir].tree = tree;
+}
+
+/* Gives a directory a name B-tree so that its entries are found, added and
+ * listed in name order in logarithmic time, and so its index doesn't have to
+ * be built at mount time.
+ * const char* path - the path of the directory
+ */
+void volume::indexDirectory(const char* path) {
+	lockTree(true);
+	int dir = findDirectory(path);
+	if (dir == -1) {
+		cerr << "Directory does not exist." << endl;
+		unlockTree(false);
+		return;
+	}
+	if (directories[dir].tree != NULL) {
+		cerr << "Directory is already indexed." << endl;
+		unlockTree(false);
+		return;
+	}
+	int tree_root = findAvailableCluster();
+	if (tree_root == -1) {
+		cerr << "Not enough free space in system." << endl;
+		unlockTree(false);
+		return;
+	}
+	setFAT(tree_root, 0xFFFF);
+	ref_count[tree_root]++;
+	directories[dir].tree = new btree(cluster_size, tree_root, allocateNode, this);
+	if (!buildTree(dir)) {
+		cerr << "Not enough free space in system." << endl;
+		freeTree(dir);
+		unlockTree();
+		return;
+	}
+	directories[dir].entries.clear();
+	setTreeRoot(dir, tree_root);
+	unlockTree();
+}
+
+/* Fills a directory's name B-tree from its table, starting from an empty
+ * root. Returns false if there wasn't room for every node.
+ * unsigned int dir - first cluster of the directory's table
+ */
+bool volume::buildTree(unsigned int dir) {
+	btree* tree = directories[dir].tree;
+	tree->format();
+	dirty_trees.insert(dir);
+	for (unsigned int cur_index = dir; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+		directory_entry* table = dir_table[cur_index];
+		for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+			if (table[i].name[0] == 0x00) continue;
+			if (!tree->insert(table[i].name, slotOffset(cur_index, i))) return false;
+		}
+	}
+	return true;
+}
+
+/* Frees a directory's name B-tree, if it has one, and its nodes.
+ * unsigned int dir - first cluster of the directory's table
+ */
+void volume::freeTree(unsigned int dir) {
+	btree* tree = directories[dir].tree;
+	if (tree == NULL) return;
+	unsigned int cur_index = tree->getRoot();
+	ref_count[cur_index]--;
+	while (cur_index != 0xFFFF && cur_index < num_clusters && ref_count[cur_index] == 0) {
+		unsigned int next_index = FileAllocationTable[cur_index];
+		setFAT(cur_index, 0x0000);
+		cur_index = next_index;
+	}
+	delete tree;
+	directories[dir].tree = NULL;
+	dirty_trees.erase(dir);
+}
+
+/* Records where a directory's name B-tree is: in the size field of the
+ * directory's entry, or in the boot record for the root directory.
+ * unsigned int dir - first cluster of the directory's table
+ * unsigned int tree_root - root node of the tree
+ */
+void volume::setTreeRoot(unsigned int dir, unsigned int tree_root) {
+	if (dir == root_index) {
+		bootrecord[8] = tree_root;
+		boot_dirty = true;
+		return;
+	}
+	unsigned int parent = directories[dir].parent;
+	for (unsigned int cur_index = parent; cur_index != 0xFFFF; cur_index = FileAllocationTable[cur_index]) {
+		directory_entry* table = dir_table[cur_index];
+		for (unsigned int i = 0; i < tableSlots(cur_index); i++) {
+			if (table[i].name[0] == 0x00 || table[i].type != DIRECTORY_TYPE || table[i].index != dir) continue;
+			directory_entry entry;
+			memcpy(&entry, &table[i], sizeof(directory_entry));
+			entry.size = tree_root;
+			writeEntry(slotOffset(cur_index, i), &entry);
+			return;
+		}
+	}
+}
+
+/* Gets a free cluster for a new node of a name B-tree and links it into the
+ * tree's chain right after the root. Returns -1 if there is none.
+ * void* context - the volume the tree belongs to
+ * unsigned int root - root node of the tree
+ */
+int volume::allocateNode(void* context, unsigned int root) {
+	volume* fs = (volume*)context;
+	int new_index = fs->findAvailableCluster(root + 1);
+	if (new_index == -1) return -1;
+	fs->setFAT(new_index, fs->FileAllocationTable[root]);
+	fs->setFAT(root, new_index);
+	return new_index;
+}
+
+/* Loads the FAT from the image into memory a chunk at a time. Parts of the
+ * FAT that are holes in the image are all free entries, so they are skipped
+ * rather than read, and marked so later scans skip them too.
+ */
+void volume::updateFAT() {
+	off_t start = (off_t)FAT_index * cluster_size;
+	off_t end = start + (off_t)num_clusters * sizeof(unsigned int);
+	off_t pos = start;
+	while (pos < end) {
+		// Find the next part of the FAT that holds data. If holes can't be
+		// found on this file system, read everything that is left.
+		off_t data_start = lseek(fs_fd, pos, SEEK_DATA);
+		if (data_start == -1 && errno == ENXIO) break;
+		if (data_start == -1) data_start = pos;
+		if (data_start >= end) break;
+		off_t data_end = lseek(fs_fd, data_start, SEEK_HOLE);
+		if (data_end == -1 || data_end > end) data_end = end;
+		// Work in whole chunks
+		unsigned int first = (data_start - start) / sizeof(unsigned int) / FAT_CHUNK * FAT_CHUNK;
+		unsigned int last = (data_end - start + sizeof(unsigned int) - 1) / sizeof(unsigned int);
+		if (last > num_clusters) last = num_clusters;
+		for (unsigned int chunk = first; chunk < last; chunk += FAT_CHUNK) {
+			unsigned int count = FAT_CHUNK;
+			if (chunk + count > num_clusters) count = num_clusters - chunk;
+			memcpy(FileAllocationTable + chunk, fs_image + start + (off_t)chunk * sizeof(unsigned int), count * sizeof(unsigned int));
+			FAT_present[chunk / FAT_CHUNK] = 1;
+		}
+		pos = start + (off_t)last * sizeof(unsigned int);
+	}
+}
+
+/* Writes the modified parts of the FAT to the file containing the file system.
+ */
+void volume::writeFAT() {
+	unsigned int* image_FAT = (unsigned int*)clusterAddress(FAT_index);
+	for (unsigned int first = 0; first < num_clusters; first += FAT_CHUNK) {
+		if (!FAT_dirty[first / FAT_CHUNK]) continue;
+		unsigned int count = FAT_CHUNK;
+		if (first + count > num_clusters) count = num_clusters - first;
+		memcpy(image_FAT + first, FileAllocationTable + first, count * sizeof(unsigned int));
+		FAT_dirty[first / FAT_CHUNK] = 0;
+		FAT_present[first / FAT_CHUNK] = 1;
+	}
+}
+
+/* Writes the modified directory entries to the file containing the file system.
+ */
+void volume::writeDT() {
+	for (set<off_t>::iterator it = dirty_entries.begin(); it != dirty_entries.end(); it++) {
+		unsigned int cluster = *it / cluster_size;
+		encodeSlot(cluster, (*it % cluster_size) / slotSize(cluster), fs_image + *it);
+	}
+	dirty_entries.clear();
+}
+
+/* Writes the boot record and the changed name B-tree nodes to the file
+ * containing the file system.
+ */
+void volume::writeTrees() {
+	if (boot_dirty) memcpy(fs_image, bootrecord, sizeof(bootrecord));
+	boot_dirty = false;
+	for (set<unsigned int>::iterator it = dirty_trees.begin(); it != dirty_trees.end(); it++) {
+		btree* tree = directories[*it].tree;
+		vector<unsigned int> nodes;
+		tree->getDirty(nodes);
+		for (unsigned int i = 0; i < nodes.size(); i++) {
+			memcpy(clusterAddress(nodes[i]), tree->nodeAddress(nodes[i]), cluster_size);
+		}
+		tree->clearDirty();
+	}
+	dirty_trees.clear();
+}
+
+/* Writes back every modified part of the FAT and directory table at the end
+ * of a call, with no locks held. Images with a journal add the changes to the
+ * current group instead, and the group is committed once it is old enough or
+ * has enough calls in it.
+ */
+void volume::flushTables() {
+	pthread_rwlock_rdlock(&tree_lock);
+	pthread_mutex_lock(&meta_lock);
+	bool dirty = tablesDirty();
+	pthread_mutex_unlock(&meta_lock);
+	pthread_rwlock_unlock(&tree_lock);
+	if (!dirty) return;
+	bool due = true;
+	if (fs_journal != NULL) {
+		pthread_mutex_lock(&commit_lock);
+		if (!group_pending) {
+			group_pending = true;
+			group_commands = 0;
+			clock_gettime(CLOCK_MONOTONIC, &group_start);
+			pthread_cond_signal(&commit_ready);
+		}
+		group_commands++;
+		due = group_commands >= GROUP_COMMIT_COMMANDS || groupAge() >= GROUP_COMMIT_MS;
+		pthread_mutex_unlock(&commit_lock);
+	}
+	if (!due) return;
+	pthread_rwlock_wrlock(&tree_lock);
+	commitGroup();
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+/* Returns true if any part of the FAT, the directory tables or their name
+ * B-trees has changed since it was last written back.
+ */
+bool volume::tablesDirty() {
+	if (!dirty_entries.empty() || !dirty_trees.empty() || boot_dirty) return true;
+	for (unsigned int i = 0; i <= num_clusters / FAT_CHUNK; i++) {
+		if (FAT_dirty[i]) return true;
+	}
+	return false;
+}
+
+/* Returns how many milliseconds ago the current group was started.
+ */
+long volume::groupAge() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - group_start.tv_sec) * 1000 + (now.tv_nsec - group_start.tv_nsec) / 1000000;
+}
+
+/* Commits every change made since the last commit. The changed runs of FAT
+ * entries, the changed directory entries and name B-tree nodes are logged
+ * to the journal and made durable with a single fdatasync, and the journal then writes them to
+ * their home locations. Images without a journal are written back directly.
+ * The tree has to be held exclusively.
+ */
+void volume::commitGroup() {
+	if (fs_journal == NULL) {
+		writeFAT();
+		writeDT();
+		writeTrees();
+		return;
+	}
+	unsigned int* image_FAT = (unsigned int*)clusterAddress(FAT_index);
+	off_t FAT_offset = (off_t)FAT_index * cluster_size;
+	for (unsigned int first = 0; first < num_clusters; first += FAT_CHUNK) {
+		if (!FAT_dirty[first / FAT_CHUNK]) continue;
+		unsigned int last = first + FAT_CHUNK;
+		if (last > num_clusters) last = num_clusters;
+		// Log each run of entries that differs from the image; runs split
+		// by only a few unchanged entries are logged as one
+		unsigned int i = first;
+		while (i < last) {
+			if (FileAllocationTable[i] == image_FAT[i]) {
+				i++;
+				continue;
+			}
+			unsigned int run_start = i;
+			unsigned int run_end = i + 1;
+			for (unsigned int j = run_end; j < last && j < run_end + 4; j++) {
+				if (FileAllocationTable[j] != image_FAT[j]) run_end = j + 1;
+			}
+			while (run_end < last && FileAllocationTable[run_end] != image_FAT[run_end]) run_end++;
+			fs_journal->add(FAT_offset + (off_t)run_start * sizeof(unsigned int),
+					(char*)(FileAllocationTable + run_start), (run_end - run_start) * sizeof(unsigned int));
+			i = run_end;
+		}
+	}
+	// Slots next to each other, such as a new table, are logged as one run
+	vector<char> run;
+	off_t run_start = 0;
+	for (set<off_t>::iterator it = dirty_entries.begin(); it != dirty_entries.end(); it++) {
+		if (!run.empty() && *it != run_start + (off_t)run.size()) {
+			fs_journal->add(run_start, &run[0], run.size());
+			run.clear();
+		}
+		if (run.empty()) run_start = *it;
+		unsigned int cluster = *it / cluster_size;
+		unsigned int size = slotSize(cluster);
+		run.resize(run.size() + size);
+		encodeSlot(cluster, (*it % cluster_size) / size, &run[run.size() - size]);
+	}
+	if (!run.empty()) fs_journal->add(run_start, &run[0], run.size());
+	if (boot_dirty) fs_journal->add(0, (char*)bootrecord, sizeof(bootrecord));
+	for (set<unsigned int>::iterator it = dirty_trees.begin(); it != dirty_trees.end(); it++) {
+		btree* tree = directories[*it].tree;
+		vector<unsigned int> nodes;
+		tree->getDirty(nodes);
+		for (unsigned int i = 0; i < nodes.size(); i++) {
+			fs_journal->add((off_t)nodes[i] * cluster_size, tree->nodeAddress(nodes[i]), cluster_size);
+		}
+		tree->clearDirty();
+	}
+	fs_journal->commit();
+	// The journal has written everything home, so the tables are clean
+	for (unsigned int first = 0; first < num_clusters; first += FAT_CHUNK) {
+		if (!FAT_dirty[first / FAT_CHUNK]) continue;
+		FAT_dirty[first / FAT_CHUNK] = 0;
+		FAT_present[first / FAT_CHUNK] = 1;
+	}
+	dirty_entries.clear();
+	dirty_trees.clear();
+	boot_dirty = false;
+	pthread_mutex_lock(&commit_lock);
+	group_pending = false;
+	pthread_mutex_unlock(&commit_lock);
+}
+
+/* Starts the thread that commits a group once it has waited GROUP_COMMIT_MS.
+ */
+void volume::startCommitter() {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&commit_ready, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_create(&commit_thread, NULL, commitWorker, this);
+}
+
+/* Commits whatever is left and stops the commit thread.
+ */
+void volume::stopCommitter() {
+	if (fs_journal == NULL) return;
+	lockTree(true);
+	commitGroup();
+	// Everything is home, so the next mount has nothing to replay
+	fs_journal->checkpoint();
+	pthread_rwlock_unlock(&tree_lock);
+	pthread_mutex_lock(&commit_lock);
+	committer_stopping = true;
+	pthread_cond_signal(&commit_ready);
+	pthread_mutex_unlock(&commit_lock);
+	pthread_join(commit_thread, NULL);
+	pthread_cond_destroy(&commit_ready);
+}
+
+/* Body of the commit thread: waits for a group to be started and commits it
+ * once it is GROUP_COMMIT_MS old, unless a call commits it first.
+ * void* arg - the volume whose groups are committed
+ */
+void* volume::commitWorker(void* arg) {
+	volume* fs = (volume*)arg;
+	pthread_mutex_lock(&fs->commit_lock);
+	while (!fs->committer_stopping) {
+		if (!fs->group_pending) {
+			pthread_cond_wait(&fs->commit_ready, &fs->commit_lock);
+			continue;
+		}
+		struct timespec deadline = fs->group_start;
+		deadline.tv_nsec += (long)GROUP_COMMIT_MS * 1000000;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&fs->commit_ready, &fs->commit_lock, &deadline);
+		if (!fs->group_pending || fs->groupAge() < GROUP_COMMIT_MS) continue;
+		// commitGroup takes commit_lock itself, after the tree
+		pthread_mutex_unlock(&fs->commit_lock);
+		pthread_rwlock_wrlock(&fs->tree_lock);
+		fs->commitGroup();
+		pthread_rwlock_unlock(&fs->tree_lock);
+		pthread_mutex_lock(&fs->commit_lock);
+	}
+	pthread_mutex_unlock(&fs->commit_lock);
+	return NULL;
+}
@@ -0,0 +1,490 @@
+/*	File: volume.h
+	Author: Liam Morris
+	Description: Blueprints a mounted FAT file system image. Everything the
+		     file system keeps in memory belongs to its volume, so any
+		     number of images can be mounted at once in one process.
+*/
+#ifndef VOLUME_H
+#define VOLUME_H
+#include <vector>
+#include <string>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "allocator.h"
+#include "btree.h"
+#include "cache.h"
+#include "ioengine.h"
+#include "extentmap.h"
+#include "journal.h"
+
+typedef struct {
+	char name[112];
+	unsigned int index;
+	unsigned int size;
+	unsigned int type;
+	unsigned int creation;
+} directory_entry;
+
+// Compact directory tables hold 32-byte entries, so four times as many fit
+// in a cluster. The first slot of a compact table cluster is a header that
+// marks it as one. Names up to 16 bytes are kept in the entry, and longer
+// ones carry on in the slots right after it, 32 bytes to a slot. Tables in
+// either format are expanded to one directory_entry per slot in memory.
+typedef struct {
+	unsigned int index;
+	unsigned int size;
+	unsigned int creation;
+	unsigned char type;
+	unsigned char length;
+	unsigned char extra;
+	unsigned char reserved;
+	char name[16];
+} compact_entry;
+
+typedef struct {
+	char magic[16];
+	unsigned int version;
+	unsigned int reserved[3];
+} compact_header;
+
+// A file opened through the random-access API. Open files follow their
+// entry when it moves; entry_index is -1 once the file has been removed.
+typedef struct {
+	bool in_use;
+	off_t entry_index;
+	int flags;
+} open_file;
+
+// What the in-memory directory index keeps for each file
+typedef struct {
+	off_t offset;
+	unsigned int index;
+	unsigned int size;
+	unsigned int type;
+} index_entry;
+
+// In-memory index of one directory, keyed by file name. Directories don't
+// store "." or ".." entries, so the parent is only kept here. A directory
+// with a name B-tree in the image uses it instead of entries, which stays
+// empty. free_hint is a cluster of its table where a free entry was last seen.
+typedef struct {
+	unsigned int parent;
+	std::unordered_map<std::string, index_entry> entries;
+	btree* tree;
+	unsigned int free_hint;
+} directory_index;
+
+class volume;
+
+// Work shared by the threads of a bulk import; each thread takes the next
+// file by bumping next
+typedef struct {
+	volume* fs;
+	std::vector<std::string> sources;
+	std::vector<std::string> names;
+	std::vector<const char*> errors;
+	std::string destination;
+	int next;
+} import_job;
+
+// What fsck finds. Clusters in the lists are the ones whose FAT entry needs
+// to be cut or freed; entries are absolute directory entry indices, and
+// stale_trees the directories whose name B-tree doesn't match their table.
+typedef struct {
+	std::vector<unsigned int> bad_links;
+	std::vector<unsigned int> cycles;
+	std::vector<unsigned int> system_links;
+	std::vector<off_t> bad_entries;
+	std::vector<off_t> short_entries;
+	std::vector<unsigned int> short_lengths;
+	std::vector<unsigned int> orphans;
+	std::vector<unsigned int> stale_trees;
+	int files;
+	int shared;
+	unsigned int first_file_walk;
+} fsck_report;
+
+// A range of the FAT checked by one fsck thread, and what it found there
+typedef struct {
+	volume* fs;
+	unsigned int first;
+	unsigned int last;
+	unsigned int* visited;
+	std::vector<unsigned int> found;
+} fsck_range;
+
+// Where defrag finds the links to each cluster while it moves them. Most
+// clusters have one link to them; the others, shared by copies, keep the rest
+// in more_links.
+typedef struct {
+	unsigned int* link;
+	std::unordered_multimap<unsigned int, unsigned int> more_links;
+	std::unordered_multimap<unsigned int, off_t> entries;
+	std::vector<unsigned int> quarantine;
+} defrag_state;
+
+// Boot record layout, one unsigned int per field:
+// 0 - cluster size, 1 - file system size in bytes (0 if it needs more than 32 bits),
+// 2 - root directory table index, 3 - FAT index, 4 - FAT length in clusters,
+// 5 - number of clusters, 6 - journal index, 7 - journal length in clusters,
+// 8 - root node of the root directory's name B-tree, 9 - format of new
+// directory table clusters.
+// Fields 4 and 5 are 0 in images made before the FAT could span more than one
+// cluster, 6 and 7 are 0 in images made without a journal, 8 is 0 while the
+// root directory isn't indexed, and 9 is 0 in images made before compact
+// tables; the rest are reserved and 0.
+const int BOOT_RECORD_WORDS = 16;
+
+// Number of locks the directories and the files are spread over
+const int DIR_LOCKS = 64;
+const int FILE_LOCKS = 256;
+
+class volume {
+public:
+	// constructor - nothing is mounted until mountImage or formatImage
+	volume();
+	// unmounts the image if one is still mounted
+	~volume();
+
+	// mounts an existing image, finishing any journal transactions first;
+	// returns false if it doesn't exist or can't be mapped
+	// image - path of the image on the host
+	// mount_point - the path that names the root of the image, such as /img
+	bool mountImage(const char* image, const std::string &mount_point);
+
+	// makes a new, empty image and mounts it; returns false if it can't be
+	// created
+	// size - size of the file system in bytes
+	// cluster_size - size of a cluster in bytes
+	bool formatImage(const char* image, const std::string &mount_point, off_t size, unsigned int cluster_size);
+
+	// commits what is left, writes everything back and closes the image;
+	// no other calls can be running
+	void unmount();
+
+	// Every call below can be made from any number of threads at once. Each
+	// call's changes are grouped with those of the calls before it and written
+	// back once the group is old or big enough.
+
+	// Sizes, in clusters unless they say otherwise
+	unsigned int getClusterSize();
+	int getClusters();
+	int numAvailableClusters();
+
+	// Directories; paths are followed one name at a time from the root, if
+	// they start with the mount point, or the current directory
+	void listDirectory(const char* path);
+	bool makeDirectory(const char* path);
+	void removeDirectory(const char* path);
+	bool changeDirectory(const char* path);
+	bool atRoot();
+	void indexDirectory(const char* path);
+	void convertTables();
+	void printDT();
+	void printFAT();
+
+	// Whole files. A copy inside the file system shares the source's clusters.
+	void createFile(const char* path);
+	void catFile(const char* path, unsigned int offset, unsigned int length);
+	void removeFile(const char* path, bool secure = false);
+	void renameFile(char* const &file_name, char* const &new_name);
+	void copyFile(const char* path, const char* new_path);
+	void exportFile(const char* path, const char* host_path, bool move);
+	std::string targetPath(const std::string &path, const char* name);
+
+	// Copies host files into the file system
+	const char* importFile(const char* host_path, const char* file_name);
+	void importFiles(char** sources, int num_sources, const char* destination);
+
+	// Random-access API: files are read and written in place at any offset
+	// through caller buffers, with errors reported in errno like pread/pwrite
+	int fs_open(const char* path, int flags);
+	ssize_t fs_pread(int fd, char* buffer, size_t count, off_t offset);
+	ssize_t fs_pwrite(int fd, const char* buffer, size_t count, off_t offset);
+	int fs_truncate(int fd, off_t length);
+	int fs_close(int fd);
+	// like fs_pread, but into a pipe without copying the bytes
+	ssize_t fs_splice(int fd, int pipe_fd, size_t count, off_t offset);
+
+	// The same work as the commands above, for programs that mount the image
+	// as a real file system, with errors reported in errno
+	int fs_stat(const char* path, struct stat* st);
+	int fs_readdir(const char* path, std::vector<struct dirent> &entries);
+	int fs_mkdir(const char* path);
+	int fs_rmdir(const char* path);
+	int fs_unlink(const char* path, bool secure = false);
+	int fs_rename(const char* path, const char* new_path, bool replace = true);
+
+	// Cluster cache and read-ahead
+	// both return false, changing nothing, for a negative number
+	bool setCacheCapacity(int capacity);
+	bool setReadAhead(int clusters);
+	void printCache();
+
+	// Maintenance
+	void defragment();
+	void printFragmentation(const char* label);
+	void checkFileSystem(bool repair);
+	void syncImage();
+
+private:
+	int fileIndex(char* const &fileName);
+	off_t fileEntry(char* const &fileName);
+
+	// Directories
+	bool resolvePath(const std::string &path, unsigned int &dir, std::string &name);
+	off_t findEntry(unsigned int dir, const std::string &name);
+	int findDirectory(const std::string &path);
+	std::string destinationPath(const std::string &path, const char* name);
+	const char* placeEntry(unsigned int dir, const std::string &name, directory_entry* entry, off_t &entry_index);
+	int moveEntry(off_t entry_index, const std::string &target, bool replace = true);
+	bool insideDirectory(unsigned int dir, unsigned int ancestor);
+	bool directoryEmpty(unsigned int dir);
+	bool lookupEntry(unsigned int dir, const std::string &name, index_entry &ie);
+	void indexEntry(off_t entry_index);
+	void unindexEntry(off_t entry_index);
+	void listContents(unsigned int dir);
+	void directoryEntries(unsigned int dir, std::vector<off_t> &entries);
+	void statEntry(off_t entry_index, struct stat* st);
+	void printEntry(directory_entry* entry);
+
+	// Name B-trees of indexed directories
+	bool buildTree(unsigned int dir);
+	void loadTree(unsigned int dir, unsigned int tree_root);
+	void freeTree(unsigned int dir);
+	void setTreeRoot(unsigned int dir, unsigned int tree_root);
+	static int allocateNode(void* context, unsigned int root);
+	void writeTrees();
+
+	// Directory index maintenance; entries are only written through these
+	void buildIndex();
+	void writeEntry(off_t entry_index, directory_entry* entry);
+	void clearEntry(off_t entry_index);
+
+	void removeEntry(off_t entry_index, bool secure = false);
+	static void* importWorker(void* arg);
+	int unshareCluster(off_t entry_index, int position);
+
+	// Locking; see the locks below for the order they are taken in
+	void lockTree(bool exclusive);
+	void unlockTree(bool flush = true);
+	void lockDirectory(unsigned int dir, bool write);
+	void unlockDirectory(unsigned int dir);
+	void lockFile(off_t entry_index, bool write);
+	void unlockFile(off_t entry_index);
+	bool lockParent(const char* path, unsigned int &dir, std::string &name, off_t &existing);
+	void unlockParent(unsigned int dir, off_t existing);
+	off_t lockEntry(const char* path, bool write);
+	off_t lockOpenFile(int fd, int access, bool write);
+
+	// Internals of the random-access API
+	directory_entry* openEntry(int fd, int access);
+	off_t readExtents(int fd, size_t &count, off_t offset, std::vector<cluster_extent> &extents);
+	void moveOpenFiles(off_t from, off_t to);
+	void copyRange(unsigned int start, off_t offset, size_t count, char* buffer, bool write);
+	void rangeExtents(unsigned int start, off_t offset, size_t count, std::vector<cluster_extent> &extents);
+	void copyExtents(std::vector<cluster_extent> &extents, size_t skip, size_t count, char* buffer, bool write);
+	bool ownClusters(off_t entry_index, unsigned int position);
+	bool truncateEntry(off_t entry_index, unsigned int length, bool zero = true);
+
+	// Image handle management; all cluster access goes through the mapped view
+	bool openImage();
+	void closeImage();
+	char* clusterAddress(int clusterIndex);
+
+	// Bulk transfers between host files and runs of clusters in the image
+	void chainExtents(unsigned int start, unsigned int offset, unsigned int size, std::vector<cluster_extent> &extents);
+	extent_map* fileExtents(unsigned int start);
+	void dropExtentMaps();
+	void dropExtentMap(unsigned int start);
+	void importExtent(int host_fd, off_t host_offset, cluster_extent run, size_t size, std::vector<io_request> &batch);
+	void exportExtent(cluster_extent run, int host_fd, off_t host_offset, size_t size, std::vector<io_request> &batch);
+
+	// Batched reads and writes through the asynchronous I/O engine; cp, cat
+	// and rm -s each hand it the runs of a whole chain
+	void queueTransfer(std::vector<io_request> &batch, int op, int fd, char* buffer, size_t length, off_t offset);
+	void printFile(std::vector<cluster_extent> &extents, size_t skip, size_t count);
+	void printBatch(std::vector<io_request> &batch);
+	void zeroClusters(std::vector<cluster_extent> &runs);
+
+	// Cluster cache and read-ahead; the cache only tracks which clusters
+	// are in use, and their data is read through the mapping or the engine
+	void adviseClusters(unsigned int start, unsigned int count, int advice);
+	void cacheCluster(int clusterIndex);
+	static void releaseCluster(void* context, int clusterIndex);
+
+	off_t findAvailableEntry(unsigned int dir, const char* name, bool grow = true);
+	off_t freeEntry(unsigned int cluster, const char* name);
+	int writeFATRecord(int writeIndex);
+	int allocateExtents(int count, std::vector<cluster_extent> &extents);
+	int linkExtents(std::vector<cluster_extent> &extents);
+	int findAvailableCluster(int hint = -1);
+	void setFAT(int index, unsigned int value);
+	void initTables();
+	void buildFreeMap();
+	void buildRefCounts();
+
+	// Loading and write-back of the in-memory FAT and directory tables
+	void updateDT();
+	void loadDirectory(unsigned int first, unsigned int parent, unsigned int tree_root);
+	void updateFAT();
+	void writeFAT();
+	void writeDT();
+	void flushTables();
+
+	// Defragmentation
+	void relocateCluster(defrag_state &state, unsigned int from, unsigned int to);
+
+	// Consistency checking
+	unsigned int walkChain(unsigned int start, unsigned int id, unsigned int* visited, fsck_report &report, unsigned int &stop);
+	void scanRanges(void* (*scan)(void*), unsigned int* visited, std::vector<unsigned int> &found);
+	static void* findBadLinks(void* arg);
+	static void* findOrphans(void* arg);
+
+	// Grouped commits of metadata changes through the journal
+	bool tablesDirty();
+	long groupAge();
+	void commitGroup();
+	void startCommitter();
+	void stopCommitter();
+	static void* commitWorker(void* arg);
+	directory_entry* entryAddress(off_t entry_index);
+
+	// Directory table clusters in the original and compact formats
+	unsigned int slotSize(unsigned int cluster);
+	unsigned int tableSlots(unsigned int cluster);
+	off_t slotOffset(unsigned int cluster, unsigned int slot);
+	unsigned int slotsNeeded(unsigned int cluster, const char* name);
+	unsigned int compactSlots(const char* name);
+	void newTable(unsigned int cluster);
+	void loadTable(unsigned int cluster);
+	void encodeSlot(unsigned int cluster, unsigned int slot, char* data);
+	void encodeTable(unsigned int cluster, char* data);
+	void claimSlots(off_t entry_index);
+	void releaseSlots(off_t entry_index);
+
+	// File system values
+	off_t fs_size;
+	unsigned int cluster_size;
+	unsigned int root_index;
+	unsigned int FAT_index;
+	unsigned int FAT_clusters;
+	unsigned int journal_index;
+	unsigned int journal_clusters;
+	unsigned int num_clusters;
+	std::string image_path;
+	std::string mount;
+
+	// Image handle, opened once at mount time, and the memory-mapped view of
+	// the whole image that all cluster access goes through
+	int fs_fd;
+	char* fs_image;
+	size_t fs_image_size;
+
+	unsigned int bootrecord[BOOT_RECORD_WORDS];
+	unsigned int* FileAllocationTable;
+	// Set when the boot record has changed and has to be written back
+	bool boot_dirty;
+
+	// The FAT and directory table are kept in memory and are the source of
+	// truth while the file system is mounted. Changes are tracked and only
+	// the modified parts are written back to the image by flushTables,
+	// through the journal if the image has one.
+	// FAT_dirty - one flag per FAT_CHUNK entries that have changed
+	// FAT_present - one flag per FAT_CHUNK entries that hold data in the
+	//               image; the others are holes, so every entry in them is free
+	// dir_table - the clusters of every directory table, keyed by cluster index
+	// dirty_entries - absolute indices of directory entries that have changed
+	char* FAT_dirty;
+	char* FAT_present;
+	std::unordered_map<unsigned int, directory_entry*> dir_table;
+	std::set<off_t> dirty_entries;
+	// Table clusters in the compact format. An entry's absolute index is the
+	// offset of its slot, which is 32 bytes in these and 128 in the others.
+	std::unordered_set<unsigned int> compact_tables;
+
+	// In-memory index of every directory, keyed by the first cluster of its
+	// table chain, and the directory each table cluster belongs to. Built
+	// once at mount time and kept up to date by writeEntry and clearEntry.
+	std::unordered_map<unsigned int, directory_index> directories;
+	std::unordered_map<unsigned int, unsigned int> dir_owner;
+
+	// Directories whose name B-tree has nodes that changed since it was last
+	// written back. A directory's tree is optional; its root is kept in the
+	// size field of the directory's entry, or in the boot record for the root.
+	std::set<unsigned int> dirty_trees;
+
+	// First cluster of the current directory inside the file system
+	unsigned int cwd_index;
+
+	// Free-cluster bitmap kept alongside the FAT; every FAT update goes
+	// through setFAT so the two never disagree. Clusters are claimed in it
+	// before they are linked into the FAT, so no two threads get the same one.
+	cluster_allocator* free_map;
+
+	// Number of references to each cluster: one for every FAT link and every
+	// directory entry that points at it. Copies inside the file system share
+	// clusters, and a cluster is only freed once nothing refers to it.
+	unsigned int* ref_count;
+
+	// Clusters that have been used recently. A miss asks the kernel to bring
+	// in the cluster and the next read_ahead clusters of its chain, and
+	// clusters that are evicted are marked as the first to be reclaimed.
+	cluster_cache* cache;
+	int read_ahead;
+
+	// Extent maps of the files that have been read far into, keyed by their
+	// first cluster. The maps are only kept in memory and are all dropped
+	// once a link in a chain that is in use changes.
+	std::unordered_map<unsigned int, extent_map*> extent_maps;
+
+	// Files opened through the random-access API, indexed by descriptor
+	std::vector<open_file> open_files;
+
+	// Asynchronous I/O engine used for bulk reads and writes of cluster runs
+	io_engine* io;
+
+	// Locks, in the order they are taken. A thread holds at most one
+	// directory lock and one file lock at a time.
+	// tree_lock - held shared by every call, and exclusively by the ones
+	//             that change more than one directory or walk all of them,
+	//             by a directory table that has to grow, and while a group is
+	//             committed. Waiting writers go first, so commits aren't held
+	//             off by a steady stream of readers.
+	// dir_locks - one per directory (shared by directories that hash to the
+	//             same lock), held for writing while its table or index changes
+	// file_locks - one per directory entry, likewise; held for reading while
+	//              a file's data is read and for writing while it is written,
+	//              so writers of different files never wait on each other
+	// meta_lock - held for short spells around changes to the FAT, the
+	//             reference counts, the extent maps, the dirty sets, the open
+	//             files and the cache; data is copied without it
+	// io_lock - the I/O engine is only used by one thread at a time
+	// The allocator's own locks come between meta_lock and io_lock.
+	pthread_rwlock_t tree_lock;
+	pthread_rwlock_t dir_locks[DIR_LOCKS];
+	pthread_rwlock_t file_locks[FILE_LOCKS];
+	pthread_mutex_t meta_lock;
+	pthread_mutex_t io_lock;
+
+	// Metadata journal, NULL for images without one. Changes made by calls
+	// are gathered into a group that is committed by flushTables once it is
+	// old or big enough, or by the commit thread once the callers have gone
+	// quiet. commit_lock guards the group's bookkeeping and is what the
+	// commit thread waits on.
+	journal* fs_journal;
+	pthread_t commit_thread;
+	pthread_mutex_t commit_lock;
+	pthread_cond_t commit_ready;
+	bool group_pending;
+	struct timespec group_start;
+	int group_commands;
+	bool committer_stopping;
+};
+#endif